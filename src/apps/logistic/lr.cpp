@@ -19,6 +19,13 @@ struct LRLocalGrad {
     val = 0;
     count = 0;
   }
+
+  float magnitude() const { return count > 0 ? std::fabs(val / count) : 0; }
+
+  void merge(const LRLocalGrad &other) {
+    val += other.val;
+    count += other.count;
+  }
 };
 
 std::ostream &operator<<(std::ostream &os, const LRParam &param) {
@@ -29,11 +36,21 @@ std::istream &operator>>(std::istream &is, LRParam &param) {
   is >> param.val;
   return is;
 }
+// whole server-side row, used when a fragment moves to another server
+BinaryBuffer &operator<<(BinaryBuffer &bb, LRParam &param) {
+  bb << param.val;
+  bb << param.grad2sum;
+  return bb;
+}
+BinaryBuffer &operator>>(BinaryBuffer &bb, LRParam &param) {
+  bb >> param.val;
+  bb >> param.grad2sum;
+  return bb;
+}
 BinaryBuffer &operator<<(BinaryBuffer &bb, LRLocalGrad &grad) {
   // CHECK_GT(grad.count, 0);
-  if (grad.count == 0)
-    return bb;
-  bb << float(grad.val / grad.count);
+  // always write a value to keep grads aligned with the key block
+  bb << float(grad.count > 0 ? grad.val / grad.count : 0);
   return bb;
 }
 BinaryBuffer &operator>>(BinaryBuffer &bb, LRLocalGrad &grad) {
@@ -138,13 +155,32 @@ public:
   typedef GlobalPullAccess<lr_key_t, LRLocalParam, LRLocalGrad> pull_access_t;
   typedef GlobalPushAccess<lr_key_t, LRLocalParam, LRLocalGrad> push_access_t;
   typedef LocalParamCache<lr_key_t, LRLocalParam, LRLocalGrad> param_cache_t;
+  typedef ParamPrefetcher<lr_key_t, LRLocalParam, LRLocalGrad> prefetcher_t;
+  typedef PersistentParamCache<lr_key_t, LRLocalParam, LRLocalGrad>
+      persistent_cache_t;
+  typedef GradBuffer<lr_key_t, LRLocalGrad> grad_buffer_t;
+  typedef InstanceArena<Instance> instance_arena_t;
 
   LR(const string &path, int niters)
       : _minibatch(global_config().get("worker", "minibatch").to_int32()),
         _nthreads(global_config().get("worker", "nthreads").to_int32()),
         _pull_access(global_pull_access<lr_key_t, LRLocalParam, LRLocalGrad>()),
         _push_access(global_push_access<lr_key_t, LRLocalParam, LRLocalGrad>()),
-        _niters(niters) {
+        _niters(niters),
+        _bsp(global_config().get("worker", "bsp_exchange", "0").to_int32() > 0),
+        _tuner(_minibatch) {
+    _minibatch = _tuner.size();
+    _cache_rows =
+        global_config().get("worker", "param_cache_rows", "0").to_int32();
+    _cache_staleness =
+        global_config().get("worker", "param_cache_staleness", "4").to_int32();
+    // the persistent cache replaces the caches taking turns
+    _prefetch =
+        global_config().get("worker", "prefetch_pull", "0").to_int32() > 0 &&
+        !_bsp && _cache_rows == 0;
+    _fuse_push_pull =
+        global_config().get("worker", "fuse_push_pull", "0").to_int32() > 0 &&
+        !_bsp && !_prefetch && _cache_rows == 0;
     _path = path;
     CHECK_GT(_path.size(), 0);
     CHECK_GT(_minibatch, 0);
@@ -157,136 +193,178 @@ public:
   void train() {
     // init server-side parameter
     FILE *file = fopen(_path.c_str(), "rb");
-    // init keys
-    gather_keys(file);
+    // init keys, counted to balance the fragments before the first pull
+    float balance_sample =
+        global_config().get("cluster", "frag_balance_sample", "0").to_float();
+    std::unordered_map<lr_key_t, int> key_freqs;
+    gather_keys(file, -1, nullptr, balance_sample > 0 ? &key_freqs : nullptr);
+    if (balance_sample > 0)
+      balance_hashfrag<lr_key_t>(key_freqs, balance_sample);
     RAW_LOG_WARNING("... to init local parameter cache");
-    _param_cache.init_keys(_local_keys);
+    param().init_keys(_local_keys);
 
     LOG(WARNING) << "... first pull to init local_param_cache";
     pull();
     LOG(WARNING) << ">>> end pull()";
     global_mpi().barrier();
 
-    std::atomic<int> line_count{0};
-    LineFileReader line_reader;
-    std::mutex file_mut;
-    SpinLock spinlock;
     double total_error{0};
     int nrecords{0};
 
-    // first to init local keys
-    // gather_keys(file);
-
-    AsynExec::task_t handler = [this, &line_count, &line_reader, &file,
-                                &file_mut, &spinlock, &total_error,
-                                &nrecords]() {
-      std::string line;
+    // the instances parsed by the gather of the minibatch are trained on
+    AsynExec::task_t handler = [this, &total_error, &nrecords]() {
       float error;
-      char *cline;
-      Instance ins;
-      bool parse_res;
-      while (true) {
-        if (feof(file))
-          break;
-        {
-          std::lock_guard<std::mutex> lk(file_mut);
-          cline = line_reader.getline(file);
-          if (!cline)
-            continue;
-          line = std::move(string(cline));
-        }
-        parse_res = parse_instance2(line, ins);
-        if (!parse_res)
-          continue;
-        // if(ins.feas.size() < 4) continue;
-        error = learn_instance(ins);
+      grad_buffer_t grads;
+      while (const Instance *ins = arena().take()) {
+        error = learn_instance(*ins, grads);
         total_error += error;
         nrecords++;
-        line_count++;
-        if (line_count > _minibatch)
-          break;
-        if (feof(file))
-          break;
       }
+      grads.merge_into(param(), _grad_locks);
     };
     LOG(WARNING) << "... to train";
+    if (_prefetch)
+      _prefetcher.reset(new prefetcher_t);
+    if (_cache_rows > 0 && !_bsp)
+      _persistent.reset(new persistent_cache_t(_cache_rows, _cache_staleness));
     for (int i = 0; i < _niters; i++) {
       LOG(WARNING) << i << "th train";
-      while (true) {
-        line_count = 0;
-        // rebuild local parameter cache
-        // LOG (INFO) << "... gather keys";
-        gather_keys(file, _minibatch);
-        _param_cache.clear();
-        _param_cache.init_keys(_local_keys);
-        // LOG (INFO) << "... to pull minibatch";
-        pull();
-        // LOG (INFO) << "... to multi-thread train";
-        async_exec(_nthreads, handler, _async_channel);
-        // LOG (INFO) << "... to push minibatch";
-        push();
-        if (feof(file))
-          break;
+      if (_prefetch) {
+        train_prefetched(file, handler);
+      } else {
+        train_iter(file, handler);
       }
+      flush_residuals();
       LOG(INFO) << nrecords << " records\terror:\t" << total_error / nrecords;
+      if (_push_access.keeps_residual()) {
+        LOG(INFO) << "push sparsity:\t" << _push_access.sparsity();
+        _push_access.reset_sparsity();
+      }
+      if (_persistent) {
+        LOG(INFO) << "pulled keys ratio:\t" << _persistent->pull_ratio();
+        _persistent->reset_stat();
+      }
       total_error = 0;
       nrecords = 0;
       // jump to file's beginning
       rewind(file);
     }
+    _prefetcher.reset();
+    _persistent.reset();
+    _clock.finish();
     LOG(WARNING) << "finish training ...";
   }
+  /**
+   * train on the file once, the minibatches are pulled and pushed in turn
+   */
+  void train_iter(FILE *file, AsynExec::task_t &handler) {
+    Timer timer;
+    BatchTimes times;
+    // rebuild local parameter cache
+    // LOG (INFO) << "... gather keys";
+    timer.start();
+    gather_keys(file, _minibatch, &arena());
+    reset_cache(param());
+    times.gather = timer.elapsed_ms();
+    // LOG (INFO) << "... to pull minibatch";
+    timer.start();
+    pull();
+    times.pull = timer.elapsed_ms();
+    while (true) {
+      // LOG (INFO) << "... to multi-thread train";
+      timer.start();
+      async_exec(_nthreads, handler, _async_channel);
+      times.compute = timer.elapsed_ms();
+      _clock.tick();
+      // in bsp mode all the workers go through the minibatches in
+      // lockstep, a worker out of data joins the exchange with no keys
+      bool has_more = !feof(file);
+      if (_bsp)
+        has_more = global_mpi().any(has_more);
+      if (!has_more) {
+        push();
+        break;
+      }
+      // the size of the next minibatch is tuned before its keys are
+      // gathered
+      _minibatch = _tuner.update(times);
+      times.clear();
+      if (_fuse_push_pull) {
+        timer.start();
+        push_pull_next(file);
+        times.push = timer.elapsed_ms();
+      } else {
+        // LOG (INFO) << "... to push minibatch";
+        timer.start();
+        push();
+        times.push = timer.elapsed_ms();
+        timer.start();
+        gather_keys(file, _minibatch, &arena());
+        reset_cache(param());
+        times.gather = timer.elapsed_ms();
+        timer.start();
+        pull();
+        times.pull = timer.elapsed_ms();
+      }
+    }
+  }
+  /**
+   * train on the file once, the next minibatch is pulled and the last
+   * one pushed while a minibatch is trained
+   */
+  void train_prefetched(FILE *file, AsynExec::task_t &handler) {
+    Timer timer;
+    BatchTimes times;
+    gather_keys(file, _minibatch, &arena());
+    _prefetcher->prefetch(std::move(_local_keys));
+    _prefetcher->next();
+    while (true) {
+      // the next minibatch is gathered before this one is trained
+      int next_minibatch = _tuner.update(times);
+      times.clear();
+      timer.start();
+      bool has_next = gather_next_keys(file, next_minibatch, next_arena());
+      if (has_next)
+        _prefetcher->prefetch(std::move(_local_keys));
+      times.gather = timer.elapsed_ms();
+      timer.start();
+      async_exec(_nthreads, handler, _async_channel);
+      times.compute = timer.elapsed_ms();
+      _minibatch = next_minibatch;
+      _clock.tick();
+      if (!has_next)
+        break;
+      _cur_arena = 1 - _cur_arena;
+      // only the pull not hidden by compute is waited for
+      timer.start();
+      _prefetcher->next();
+      times.pull = timer.elapsed_ms();
+    }
+    _prefetcher->flush();
+  }
 
   void predict(const std::string &path, const std::string &out) {
     LOG(WARNING) << "to predict " << path;
-    std::atomic<int> line_count{0};
-    LineFileReader line_reader;
-    std::mutex file_mut;
-    SpinLock spinlock;
     double total_error{0};
     int nrecords{0};
     FILE *file = fopen(_path.c_str(), "rb");
     std::ofstream outfile(out.c_str());
-    AsynExec::task_t handler = [this, &line_count, &line_reader, &file,
-                                &file_mut, &spinlock, &total_error, &nrecords,
-                                &outfile]() {
-      std::string line;
+    // a single thread takes the instances in the order of the lines
+    AsynExec::task_t handler = [this, &total_error, &nrecords, &outfile]() {
       float error, predict;
-      char *cline;
-      Instance ins;
-      bool parse_res;
-      while (true) {
-        if (feof(file))
-          break;
-        {
-          std::lock_guard<std::mutex> lk(file_mut);
-          cline = line_reader.getline(file);
-          if (!cline)
-            continue;
-          line = std::move(string(cline));
-        }
-        parse_res = parse_instance2(line, ins);
-        if (!parse_res)
-          continue;
-        // if(ins.feas.size() < 4) continue;
-        error = predict_instance(ins, predict);
+      while (const Instance *ins = arena().take()) {
+        error = predict_instance(*ins, predict);
         outfile << predict << std::endl;
         total_error += error;
         nrecords++;
-        line_count++;
-        if (line_count > _minibatch)
-          break;
-        if (feof(file))
-          break;
       }
     };
 
     while (true) {
-      line_count = 0;
       // rebuild local parameter cache
-      gather_keys(file, _minibatch);
-      _param_cache.clear();
-      _param_cache.init_keys(_local_keys);
+      gather_keys(file, _minibatch, &arena());
+      param().clear();
+      param().init_keys(_local_keys);
       pull();
       async_exec(1, handler, _async_channel);
       if (feof(file))
@@ -300,45 +378,116 @@ public:
   }
 
 protected:
+  param_cache_t &param() {
+    if (_prefetcher)
+      return _prefetcher->cache();
+    if (_persistent)
+      return _persistent->cache();
+    return _param_caches[_cur_cache];
+  }
+  // instances of the minibatch in training
+  instance_arena_t &arena() { return _arenas[_cur_arena]; }
+  // instances of the minibatch gathered next in the prefetch mode
+  instance_arena_t &next_arena() { return _arenas[1 - _cur_arena]; }
+  /**
+   * push the residuals of sparse push left at the end of an iteration,
+   * the prefetcher pushes its own when flushed
+   */
+  void flush_residuals() {
+    if (_prefetcher)
+      return;
+    if (_persistent) {
+      _persistent->flush();
+      return;
+    }
+    for (auto &cache : _param_caches)
+      _push_access.flush_residuals(cache, _bsp);
+  }
+  /**
+   * rebuild the cache for the keys of a minibatch
+   */
+  void reset_cache(param_cache_t &cache) {
+    // rows of the persistent cache are kept across minibatches
+    if (_persistent)
+      return;
+    // residual grads of sparse push should be kept
+    if (_push_access.keeps_residual())
+      cache.clear_params();
+    else
+      cache.clear();
+    cache.init_keys(_local_keys);
+  }
+  /**
+   * push the grads of the trained minibatch and pull the next one in a
+   * single round trip, the two caches take turns
+   */
+  void push_pull_next(FILE *file) {
+    std::unordered_set<lr_key_t> push_keys;
+    push_keys.swap(_local_keys);
+    gather_keys(file, _minibatch, &arena());
+    param_cache_t &push_cache = param();
+    _cur_cache = 1 - _cur_cache;
+    reset_cache(param());
+    _push_access.push_pull_with_barrier(push_keys, push_cache, _local_keys,
+                                        param());
+  }
   /**
    * @brief gather keys within a minibatch
    * @param file file with fopen
    * @param minibatch size of Mini-batch, no limit if minibatch < 0
+   * @param arena keeps the parsed instances for training, and the file is
+   * left after the lines gathered; if null the file is read again
+   * @param key_freqs counts the occurrences of the keys if not null
    */
-  void gather_keys(FILE *file, int minibatch = -1) {
+  void gather_keys(FILE *file, int minibatch = -1,
+                   instance_arena_t *arena = nullptr,
+                   std::unordered_map<lr_key_t, int> *key_freqs = nullptr) {
     long cur_pos = ftell(file);
     std::atomic<int> line_count{0};
     LineFileReader line_reader;
     std::mutex file_mut;
     SpinLock spinlock;
     _local_keys.clear();
+    if (arena)
+      arena->clear();
     // CounterBarrier cbarrier(_nthreads);
 
     AsynExec::task_t handler = [this, &line_count, &line_reader, &file_mut,
-                                &spinlock, minibatch, &file] {
+                                &spinlock, minibatch, &file, arena,
+                                key_freqs] {
       char *cline = nullptr;
       std::string line;
-      Instance ins;
+      Instance local_ins;
       bool parse_res;
       while (true) {
         if (feof(file))
           break;
-        ins.clear();
+        Instance *ins = &local_ins;
+        instance_arena_t::Entry *entry = nullptr;
         {
           std::lock_guard<std::mutex> lk(file_mut);
           cline = line_reader.getline(file);
           if (!cline)
             continue;
           line = std::move(string(cline));
+          if (arena) {
+            entry = &arena->append();
+            ins = &entry->ins;
+          }
         }
-        parse_res = parse_instance2(line, ins);
+        ins->clear();
+        parse_res = parse_instance2(line, *ins);
+        if (entry)
+          entry->valid = parse_res;
         if (!parse_res)
           continue;
         // if(ins.feas.size() < 4) continue;
         {
-          std::lock_guard<SpinLock> lk(SpinLock);
-          for (const auto &item : ins.feas) {
+          std::lock_guard<SpinLock> lk(spinlock);
+          for (const auto &item : ins->feas) {
             _local_keys.insert(item.first);
+            if (key_freqs)
+              (*key_freqs)[item.first]++;
           }
         }
         line_count++;
@@ -350,16 +499,30 @@ protected:
     };
     async_exec(_nthreads, handler, _async_channel);
     // RAW_LOG(INFO, "collect %d keys", _local_keys.size());
-    fseek(file, cur_pos, SEEK_SET);
+    if (!arena)
+      fseek(file, cur_pos, SEEK_SET);
+  }
+  /**
+   * @brief gather the minibatch after the one gathered last into `arena`
+   * @return false if no line is left
+   */
+  bool gather_next_keys(FILE *file, int minibatch, instance_arena_t &arena) {
+    int c = fgetc(file);
+    bool has_next = c != EOF;
+    if (has_next) {
+      ungetc(c, file);
+      gather_keys(file, minibatch, &arena);
+    }
+    return has_next;
   }
   /**
-   * SGD update
+   * SGD update, grads are written to the buffer of the thread
    */
-  float learn_instance(const Instance &ins) {
+  float learn_instance(const Instance &ins, grad_buffer_t &grads) {
     float sum = 0;
     for (const auto &item : ins.feas) {
-      auto param = _param_cache.params()[item.first];
-      sum += param * item.second;
+      auto weight = param().params()[item.first];
+      sum += weight * item.second;
     }
     float predict = 1. / (1. + exp(-sum));
     float error = ins.target - predict;
@@ -367,17 +530,18 @@ protected:
     float grad = 0;
     for (const auto &item : ins.feas) {
       grad = error * item.second;
-      _param_cache.grads()[item.first].val += grad;
+      LRLocalGrad &local_grad = grads[item.first];
+      local_grad.val += grad;
       // RAW_LOG_INFO( "grad:\t%d:%f", item.first, grad);
-      _param_cache.grads()[item.first].count++;
+      local_grad.count++;
     }
     return error * error;
   }
   float predict_instance(const Instance &ins, float &predict) {
     float sum = 0;
     for (const auto &item : ins.feas) {
-      auto param = _param_cache.params()[item.first];
-      sum += param * item.second;
+      auto weight = param().params()[item.first];
+      sum += weight * item.second;
     }
     predict = 1. / (1. + exp(-sum));
     float error = ins.target - predict;
@@ -388,12 +552,24 @@ protected:
   /**
    * query parameters contained in local cache from remote server
    */
-  void pull() { _pull_access.pull_with_barrier(_local_keys, _param_cache); }
+  void pull() {
+    if (_persistent)
+      _persistent->pull(_local_keys);
+    else if (_bsp)
+      _pull_access.pull_bsp(_local_keys, param());
+    else
+      _pull_access.pull_with_barrier(_local_keys, param());
+  }
   /**
    * update server-side parameters with local grad
    */
   void push() {
-    _push_access.push_with_barrier(_local_keys, _param_cache);
+    if (_persistent)
+      _persistent->push(_local_keys);
+    else if (_bsp)
+      _push_access.push_bsp(_local_keys, param());
+    else
+      _push_access.push_with_barrier(_local_keys, param());
     _local_keys.clear();
   }
 
@@ -405,9 +581,32 @@ private:
   int _niters;
   pull_access_t &_pull_access;
   push_access_t &_push_access;
-  param_cache_t _param_cache;
+  // the cache of the minibatch in training and the one of the next
+  param_cache_t _param_caches[2];
+  int _cur_cache = 0;
   std::unordered_set<lr_key_t> _local_keys;
   std::shared_ptr<AsynExec::channel_t> _async_channel;
+  // collective pull and push
+  bool _bsp;
+  // push a minibatch and pull the next in one request
+  bool _fuse_push_pull;
+  // pull the next minibatch and push the last one while one is trained
+  bool _prefetch;
+  std::unique_ptr<prefetcher_t> _prefetcher;
+  // locks the grads of the cache while the threads merge theirs
+  StripedLock _grad_locks;
+  // rows kept across minibatches, null if not enabled
+  int _cache_rows;
+  int _cache_staleness;
+  std::unique_ptr<persistent_cache_t> _persistent;
+  // instances of the minibatch in training and of the next one, the
+  // second is used in the prefetch mode only
+  instance_arena_t _arenas[2];
+  int _cur_arena = 0;
+  // stale synchronous mode
+  SSPClock _clock;
+  // size of the minibatches, fixed if not enabled
+  MiniBatchTuner _tuner;
 };
 
 int main(int argc, char **argv) {
@@ -482,10 +681,13 @@ int main(int argc, char **argv) {
   // init cluster
   Cluster<ClusterWorker, server_t, lr_key_t> cluster;
   cluster.initialize();
+  HostAggregator<lr_key_t, LRLocalParam, LRLocalGrad> aggregator;
   LR lr(C(param_dataset), stoi(C(param_niters)));
   // to train
   if (C(param_mode) == "train") {
     lr.train();
+    global_hot_key_cache<lr_key_t, LRLocalParam, LRLocalGrad>().flush();
+    aggregator.finalize();
     std::string out_param_path =
         global_config().get("server", "out_param_prefix").to_string();
     // swift_snails::format_string(out_param_path, "-%d.txt",
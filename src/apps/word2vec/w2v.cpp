@@ -48,9 +48,12 @@ int main(int argc, char *argv[]) {
   // init cluster
   Cluster<ClusterWorker, server_t, w2v_key_t> cluster;
   cluster.initialize();
+  HostAggregator<w2v_key_t, WLocalParam, WLocalGrad> aggregator;
 
   Word2Vec<MiniBatch> w2v(data_path, niters);
   w2v.train();
+  global_hot_key_cache<w2v_key_t, WLocalParam, WLocalGrad>().flush();
+  aggregator.finalize();
   swift_snails::format_string(output_path, "-%d.txt", global_mpi().rank());
   RAW_LOG_WARNING("server output parameter to %s", output_path.c_str());
   cluster.finalize(output_path);
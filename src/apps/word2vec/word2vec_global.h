@@ -1,6 +1,7 @@
 #pragma once
 #include <functional>
 #include "../../swiftmpi.h"
+#include "word2vec_param.h"
 using namespace swift_snails;
 
 #define EXP_TABLE_SIZE 1000
@@ -8,196 +9,18 @@ using namespace swift_snails;
 const int table_size = 1e8;
 size_t train_words = 0;
 size_t actual_train_words = 0;
-/**
- * parameter vector's dimention
- */
-int len_vec() {
-  static int _len_vec = 0;
-  if (_len_vec == 0) {
-    _len_vec = global_config().get("word2vec", "len_vec").to_int32();
-    CHECK_GT(_len_vec, 0);
-  }
-  return _len_vec;
-}
-
-bool &to_output_sent() {
-  static bool _status = false;
-  return _status;
-}
-/**
- * words will be std::hash-ed to size_t
- */
-typedef size_t w2v_key_t;
-/**
- * Word2Vec Server-side parameter type
- */
-struct WParam {
-  Vec h, v, h2sum, v2sum;
-  // sentence vector or not
-  // used in sent2vec
-  bool is_sent = false;
-
-  WParam() {
-    h.init(len_vec());
-    h.random();
-    v.init(len_vec());
-    v.random();
-    h2sum.init(len_vec());
-    v2sum.init(len_vec());
-  }
-};
-/**
- * Local parameter type
- */
-struct WLocalParam {
-  Vec h, v;
-
-  WLocalParam() {
-    h.init(len_vec());
-    v.init(len_vec());
-  }
-};
-/**
- * Local gradient type
- */
-struct WLocalGrad {
-  Vec h_grad, v_grad;
-  int h_count = 0, v_count = 0;
-  // sentence vector or not
-  // used in sent2vec
-  bool is_sent = false;
-
-  WLocalGrad() {
-    h_grad.init(len_vec());
-    v_grad.init(len_vec());
-    h_count = 0;
-    v_count = 0;
-  }
-
-  void accu_h(const Vec &grad) {
-    h_count++;
-    h_grad += grad;
-  }
-
-  void accu_v(const Vec &grad) {
-    v_count++;
-    v_grad += grad;
-  }
-
-  void reset() {
-    h_grad.clear();
-    v_grad.clear();
-    h_count = 0;
-    v_count = 0;
-  }
-
-  void norm() {
-    if (h_count > 0)
-      h_grad /= static_cast<float>(h_count);
-    if (v_count > 0)
-      h_grad /= static_cast<float>(v_count);
-  }
-};
-
-std::ostream &operator<<(std::ostream &os, const WParam &param) {
-  if (param.is_sent == to_output_sent()) {
-    for (int i = 0; i < len_vec() - 1; i++)
-      os << param.v[i] << " ";
-    os << param.v[len_vec() - 1] << "\t";
-    for (int i = 0; i < len_vec() - 1; i++)
-      os << param.h[i] << " ";
-    os << param.h[len_vec() - 1];
-  }
-  return os;
-}
-std::istream &operator>>(std::istream &is, WParam &param) {
-  for (int i = 0; i < len_vec(); i++) {
-    is >> param.v[i];
-  }
-  for (int i = 0; i < len_vec(); i++) {
-    is >> param.h[i];
-  }
-  return is;
-}
-BinaryBuffer &operator<<(BinaryBuffer &bb, WLocalGrad &grad) {
-  // CHECK_GT (grad.count, 0);
-  bb << grad.is_sent;
-  if (grad.h_count > 0)
-    grad.h_grad /= grad.h_count;
-  if (grad.v_count > 0)
-    grad.v_grad /= grad.v_count;
-  for (int i = 0; i < len_vec(); i++) {
-    bb << grad.h_grad[i];
-    bb << grad.v_grad[i];
-  }
-  return bb;
-}
-BinaryBuffer &operator>>(BinaryBuffer &bb, WLocalGrad &grad) {
-  bb >> grad.is_sent;
-  for (int i = 0; i < len_vec(); i++) {
-    bb >> grad.h_grad[i];
-    bb >> grad.v_grad[i];
-  }
-  return bb;
-}
-BinaryBuffer &operator<<(BinaryBuffer &bb, WLocalParam &param) {
-  for (int i = 0; i < len_vec(); i++) {
-    bb << param.h[i];
-    bb << param.v[i];
-  }
-  return bb;
-}
-BinaryBuffer &operator>>(BinaryBuffer &bb, WLocalParam &param) {
-  for (int i = 0; i < len_vec(); i++) {
-    bb >> param.h[i];
-    bb >> param.v[i];
-  }
-  return bb;
-}
-
-class WPullAccessMethod
-    : public PullAccessMethod<w2v_key_t, WParam, WLocalParam> {
-public:
-  virtual void init_param(const w2v_key_t &key, param_t &param) {}
-  virtual void get_pull_value(const w2v_key_t &key, const param_t &param,
-                              pull_t &val) noexcept {
-    val.h = param.h;
-    val.v = param.v;
-  }
-};
-
-class WPushAccessMethod
-    : public PushAccessMethod<w2v_key_t, WParam, WLocalGrad> {
-public:
-  WPushAccessMethod()
-      : initial_learning_rate(
-            global_config().get("server", "initial_learning_rate").to_float()) {
-  }
-  virtual void apply_push_value(const w2v_key_t &key, param_t &param,
-                                const grad_t &push_val) noexcept {
-    param.is_sent = push_val.is_sent;
-    param.h2sum += push_val.h_grad * push_val.h_grad;
-    param.v2sum += push_val.v_grad * push_val.v_grad;
-    param.h += initial_learning_rate * push_val.h_grad /
-               (swift_snails::sqrt(param.h2sum + fudge_factor));
-    param.v += initial_learning_rate * push_val.v_grad /
-               (swift_snails::sqrt(param.v2sum + fudge_factor));
-  }
-
-private:
-  float initial_learning_rate;
-  static const float fudge_factor;
-};
-const float WPushAccessMethod::fudge_factor = 1e-6;
 
 struct Instance {
   std::vector<w2v_key_t> words;
+  // slots of the words in the parameter cache
+  std::vector<int> slots;
 
   w2v_key_t sent_id;
 
   void clear() {
     // clear data but not free memory
     words.clear();
+    slots.clear();
     sent_id = -1;
   }
 }; // end struct Instance
@@ -230,6 +53,12 @@ typedef ClusterServer<w2v_key_t, WParam, WLocalParam, WLocalGrad,
                       WPullAccessMethod, WPushAccessMethod> server_t;
 typedef GlobalPullAccess<w2v_key_t, WLocalParam, WLocalGrad> pull_access_t;
 typedef GlobalPushAccess<w2v_key_t, WLocalParam, WLocalGrad> push_access_t;
+typedef PushCombiner<w2v_key_t, WLocalParam, WLocalGrad> push_combiner_t;
+typedef SharedPullCache<w2v_key_t, WLocalParam, WLocalGrad,
+                        SlotParamCache<w2v_key_t, WLocalParam, WLocalGrad>>
+    shared_cache_t;
+typedef SlotGradBuffer<SlotParamCache<w2v_key_t, WLocalParam, WLocalGrad>>
+    grad_buffer_t;
 
 std::shared_ptr<AsynExec::channel_t> &global_channel() {
   static AsynExec async(global_config().get("worker", "nthreads").to_int32());
@@ -278,12 +107,13 @@ ExpTable exptable;
  *
  *  gather_keys()
  *  pull()
- *  ...
+ *  train on instances()
  *  push()
  */
 class MiniBatch {
 public:
-  typedef LocalParamCache<w2v_key_t, WLocalParam, WLocalGrad> param_cache_t;
+  typedef SlotParamCache<w2v_key_t, WLocalParam, WLocalGrad> param_cache_t;
+  typedef InstanceArena<Instance> instance_arena_t;
   /**
    * query parameters contained in local cache from remote server
    */
@@ -321,48 +151,104 @@ public:
     // gen_unigram_table();
   }
   /**
-   * update server-side parameters with local grad
+   * pull in a collective, all the workers should call it together
+   */
+  void pull_bsp() { _pull_access.pull_bsp(_local_keys, param()); }
+  /**
+   * pull through the cache shared by the threads, the keys are held
+   * until `release()`
+   */
+  void pull(shared_cache_t &shared_cache) {
+    shared_cache.acquire(_local_keys);
+    _held_keys = _local_keys;
+  }
+  void release(shared_cache_t &shared_cache) {
+    shared_cache.release(_held_keys);
+    _held_keys.clear();
+  }
+  /**
+   * update server-side parameters with the grads of a thread
+   *
+   * @param flush push the residuals of a sparse push as well
+   */
+  void push(grad_buffer_t &grads, bool flush = false) {
+    std::unordered_set<w2v_key_t> keys;
+    grads.keys(keys);
+    _push_access.push_with_barrier(keys, grads, flush);
+    // residual grads of sparse push stay to be pushed later
+    if (flush || !_push_access.keeps_residual())
+      grads.clear();
+    clear();
+  }
+  /**
+   * hand the grads of a thread to the process-wide combiner instead of
+   * pushing them
    */
-  void push() {
-    _push_access.push_with_barrier(_local_keys, param());
+  void push(grad_buffer_t &grads, push_combiner_t &combiner) {
+    std::unordered_set<w2v_key_t> keys;
+    grads.keys(keys);
+    combiner.deposit(keys, grads);
+    grads.clear();
     clear();
   }
+  /**
+   * push the grads of the current minibatch and pull the keys of the
+   * next one in a single round trip
+   */
+  void push_pull(FILE *file, int &line_id, int minibatch, int nthreads,
+                 grad_buffer_t &grads, long long end = -1) {
+    std::unordered_set<w2v_key_t> push_keys;
+    grads.keys(push_keys);
+    gather_keys(file, line_id, minibatch, nthreads, end);
+    _push_access.push_pull_with_barrier(push_keys, grads, _local_keys,
+                                        param());
+    if (!_push_access.keeps_residual())
+      grads.clear();
+  }
   /**
    * gather keys within a minibatch
    *
+   * the parsed lines are kept in `instances()` to be trained on, and the
+   * file is left after them.
+   *
    * @param minibatch size of the minibatch
+   * @param end no line starting at or after `end` is read if >= 0
    */
   size_t gather_keys(FILE *file, int &line_id, int minibatch,
-                     int nthreads = 0) {
-    long cur_pos = ftell(file);
+                     int nthreads = 0, long long end = -1) {
     int line_count{0};
     line_id = 0;
     std::mutex file_mut;
     SpinLock spinlock1, spinlock2;
     _local_keys.clear();
+    _instances.clear();
     nthreads = nthreads == 0 ? _nthreads : nthreads;
     AsynExec::task_t handler = [this, &line_count, &line_id, &file_mut,
-                                &spinlock1, &spinlock2, minibatch, &file] {
+                                &spinlock1, &spinlock2, minibatch, &file,
+                                end] {
       LineFileReader line_reader;
       char *cline = nullptr;
       std::string line;
-      Instance ins;
-      bool parse_res;
+      instance_arena_t::Entry *entry;
       while (true) {
         if (feof(file))
           break;
-        ins.clear();
         {
           std::lock_guard<std::mutex> lk(file_mut);
+          if (end >= 0 && ftell(file) >= end)
+            break;
           cline = line_reader.getline(file);
           if (!cline)
             continue;
+          line = std::move(std::string(cline));
+          entry = &_instances.append();
         }
-        line = std::move(std::string(cline));
-        parse_res = parse_instance(line, ins);
-        if (!parse_res)
+        entry->valid = parse_instance(line, entry->ins);
+        if (!entry->valid)
           continue;
-        for (const auto &item : ins.words) {
+        // the rows of the words are indexed by slots in training
+        param().translate(entry->ins.words, entry->ins.slots);
+        for (const auto &item : entry->ins.words) {
           std::lock_guard<SpinLock> lk(spinlock2);
           _local_keys.insert(item);
         }
@@ -376,7 +262,6 @@ public:
     };
     async_exec(nthreads, handler, global_channel());
     RAW_DLOG(INFO, "collect %lu keys", _local_keys.size());
-    fseek(file, cur_pos, SEEK_SET);
     return _local_keys.size();
   }
   /**
@@ -439,15 +324,19 @@ public:
     gen_unigram_table();
 
     param().init_keys(_local_keys);
+    gen_slot_table();
 
     return _local_keys.size();
   }
 
   param_cache_t &param() noexcept { return *_param_cache; }
+  // instances of the minibatch gathered last
+  instance_arena_t &instances() noexcept { return _instances; }
 
   const std::map<w2v_key_t, int> &word_freq() noexcept { return _word_freq; }
 
-  w2v_key_t *table() noexcept { return _table; }
+  // unigram table of slots, for negative sampling
+  const int *slot_table() const noexcept { return &_slot_table[0]; }
 
   virtual void clear() noexcept {
     _local_keys.clear();
@@ -495,10 +384,26 @@ protected:
     _wordids.clear();
     std::vector<w2v_key_t>().swap(_wordids);
   }
+  /**
+   * translate the unigram table to slots once the keys are in the cache,
+   * the table of keys is dropped
+   */
+  void gen_slot_table() {
+    CHECK(_table != nullptr) << "unigram table should be generated before";
+    _slot_table.resize(table_size);
+    for (int a = 0; a < table_size; a++)
+      _slot_table[a] = param().slot(_table[a]);
+    delete[] _table;
+    _table = nullptr;
+  }
   /**
    * @warning local_keys, word_freq, wordids should be consitant with each other
    */
   std::unordered_set<w2v_key_t> _local_keys;
+  // keys held in the shared cache
+  std::unordered_set<w2v_key_t> _held_keys;
+  // lines parsed by the last gather, reused across minibatches
+  instance_arena_t _instances;
   std::map<w2v_key_t, int> _word_freq;
   std::vector<w2v_key_t> _wordids;
   pull_access_t &_pull_access;
@@ -508,6 +413,7 @@ protected:
   int _nthreads = 0;
   // cache number of words in this minibatch
   w2v_key_t *_table = nullptr;
+  std::vector<int> _slot_table;
   // status
   static long long _file_size;
 }; // end class MiniBatch
@@ -540,13 +446,35 @@ public:
         _negative(global_config().get("word2vec", "negative").to_int32()),
         _sample(global_config().get("word2vec", "sample").to_float()),
         _alpha(global_config().get("word2vec", "learning_rate").to_float()),
-        _niters(niters) {
+        _niters(niters),
+        _fuse_push_pull(
+            global_config().get("worker", "fuse_push_pull", "0").to_int32() >
+            0),
+        _clock(_nthreads), _local_sgd(LocalSGDSchedule().enabled()) {
     _path = path;
     CHECK_GT(_path.size(), 0);
     CHECK_GT(_batchsize, 0);
     CHECK_GT(_nthreads, 0);
     CHECK_GT(_niters, 0);
     _minibatch.init_param(&_param_cache);
+    // a sync pushes the grads of all the minibatches since the last one
+    to_push_grad_sum() = _local_sgd;
+    int combine_interval =
+        global_config().get("worker", "push_combine_interval", "0").to_int32();
+    if (combine_interval > 0) {
+      _combiner.reset(new push_combiner_t(combine_interval));
+      // the combined push is apart from the pull of the next minibatch
+      _fuse_push_pull = false;
+    }
+    if (global_config().get("worker", "shared_pull_cache", "0").to_int32() >
+        0) {
+      _shared_cache.reset(new shared_cache_t(_param_cache));
+      _fuse_push_pull = false;
+    }
+    int chunk_bytes =
+        global_config().get("worker", "data_chunk_bytes", "0").to_int32();
+    if (chunk_bytes > 0)
+      _chunks.reset(new ChunkQueue(_path, chunk_bytes));
   }
 
   void train() {
@@ -558,8 +486,15 @@ public:
       return;
     LOG(INFO) << "local data has " << nlines << " lines\t" << train_words
               << " words";
+    float balance_sample =
+        global_config().get("cluster", "frag_balance_sample", "0").to_float();
+    if (balance_sample > 0)
+      balance_hashfrag<w2v_key_t>(_minibatch.word_freq(), balance_sample);
     LOG(INFO) << "to pull request";
-    _minibatch.pull();
+    if (global_config().get("worker", "bsp_exchange", "0").to_int32() > 0)
+      _minibatch.pull_bsp();
+    else
+      _minibatch.pull();
     global_mpi().barrier();
 
     _minibatch.clear();
@@ -570,7 +505,18 @@ public:
     for (int i = 0; i < _niters; i++) {
       error = train_iter(_path);
       LOG(INFO) << "iter\t" << i << "\terror:\t" << error;
+      auto &push_access =
+          global_push_access<w2v_key_t, WLocalParam, WLocalGrad>();
+      if (push_access.keeps_residual()) {
+        LOG(INFO) << "push sparsity:\t" << push_access.sparsity();
+        push_access.reset_sparsity();
+      }
+      if (_shared_cache) {
+        LOG(INFO) << "pulled keys ratio:\t" << _shared_cache->pull_ratio();
+        _shared_cache->reset_stat();
+      }
     }
+    _clock.finish_all();
     fclose(file);
   }
 
@@ -585,11 +531,25 @@ public:
     for (auto &t : threads) {
       t.join();
     }
+    if (_combiner)
+      _combiner->flush(true);
+    _epoch++;
     return _error.norm();
   }
 
   void TrainModelThread(int id) {
+    if (_chunks) {
+      TrainChunksThread(id);
+      return;
+    }
     MiniBatchT minibatch(&_param_cache);
+    grad_buffer_t grads(_param_cache);
+    LocalSGDSchedule schedule;
+    // every thread tunes the size of its minibatches
+    MiniBatchTuner tuner(_batchsize);
+    int batchsize = tuner.size();
+    Timer timer;
+    BatchTimes times;
     Vec neu1(len_vec()), neu1e(len_vec());
     FILE *file = fopen(_path.c_str(), "rb");
     if (file == NULL) {
@@ -598,67 +558,154 @@ public:
     }
     fseek(file, minibatch.file_size() / (long long)_nthreads * (long long)id,
           SEEK_SET);
-    std::string line;
-    char *cline;
-    Instance ins;
-    bool parse_res;
-    int line_counter = 0, last_line_counter = 0, line_id;
+    int line_id;
     size_t cur_train_words = 0;
-    LineFileReader line_reader(file);
+    // the lines are read and parsed once, by the gather of a minibatch
+    auto &instances = minibatch.instances();
+    minibatch.gather_keys(file, line_id, batchsize, 3);
+    pull(minibatch);
+    timer.start();
 
     while (true) {
-      if (feof(file))
+      while (Instance *ins = instances.take()) {
+        learn_instance(*ins, neu1, neu1e, grads);
+        // update status
+        cur_train_words += ins->words.size();
+        actual_train_words += ins->words.size();
+      }
+      times.compute += timer.elapsed_ms();
+      if (feof(file) || cur_train_words > train_words / _nthreads)
         break;
-      // read a line from file
-      cline = line_reader.getline();
-      if (!cline)
-        continue;
-      line = std::move(std::string(cline));
-      parse_res = parse_instance(line, ins);
-      learn_instance(ins, neu1, neu1e);
-      // update status
-      cur_train_words += ins.words.size();
-      actual_train_words += ins.words.size();
-      line_counter++;
-      // RAW_LOG_INFO
-      // ("line_counter:\t%d\tcur_train_words:\t%d\tword_task:\t%d",
-      // line_counter, cur_train_words, train_words / _nthreads);
-      // RAW_LOG_INFO( "train status:\t%f\t%d/%d",
-      // (float)actual_train_words/train_words, actual_train_words,
-      // train_words);
-
-      if (line_counter == 1) {
-        minibatch.gather_keys(file, line_id, _batchsize, 3);
-        minibatch.pull();
+      _clock.tick(id);
+      // in the local SGD mode minibatches between syncs are trained on
+      // the local cache, their lines are gathered without a pull
+      if (schedule.step()) {
+        batchsize = tuner.update(times);
+        times.clear();
+        sync(minibatch, grads, file, line_id, batchsize, times);
+      } else {
+        minibatch.gather_keys(file, line_id, batchsize, 3);
       }
+      RAW_LOG_INFO("train status:\t%f\t%d/%d",
+                   (float)actual_train_words / train_words,
+                   actual_train_words, train_words);
+      timer.start();
+    }
 
-      if (line_counter > 0 && line_counter % _batchsize == 0) {
-        minibatch.push();
-        minibatch.clear();
-        minibatch.gather_keys(file, line_id, _batchsize, 3);
-        minibatch.pull();
+    push(minibatch, grads, true);
+  }
+  /**
+   * train on the chunks taken from the queue until none is left, a
+   * minibatch does not cross chunks
+   */
+  void TrainChunksThread(int id) {
+    MiniBatchT minibatch(&_param_cache);
+    grad_buffer_t grads(_param_cache);
+    LocalSGDSchedule schedule;
+    // every thread tunes the size of its minibatches
+    MiniBatchTuner tuner(_batchsize);
+    int batchsize = tuner.size();
+    Timer timer;
+    BatchTimes times;
+    Vec neu1(len_vec()), neu1e(len_vec());
+    FILE *file = fopen(_path.c_str(), "rb");
+    CHECK(file) << "no such file or directory: " << _path;
+    int line_id;
+    long long begin, end;
+    auto &instances = minibatch.instances();
+
+    while (_chunks->next(_epoch, begin, end)) {
+      ChunkQueue::seek(file, begin);
+      minibatch.gather_keys(file, line_id, batchsize, 3, end);
+      pull(minibatch);
+      timer.start();
+      while (true) {
+        while (Instance *ins = instances.take()) {
+          learn_instance(*ins, neu1, neu1e, grads);
+          actual_train_words += ins->words.size();
+        }
+        times.compute += timer.elapsed_ms();
+        if (feof(file) || ftell(file) >= end)
+          break;
+        _clock.tick(id);
+        if (schedule.step()) {
+          batchsize = tuner.update(times);
+          times.clear();
+          sync(minibatch, grads, file, line_id, batchsize, times, end);
+        } else {
+          minibatch.gather_keys(file, line_id, batchsize, 3, end);
+        }
         RAW_LOG_INFO("train status:\t%f\t%d/%d",
                      (float)actual_train_words / train_words,
                      actual_train_words, train_words);
-        last_line_counter = line_counter;
+        timer.start();
       }
-
-      if (cur_train_words > train_words / _nthreads)
-        break;
+      push(minibatch, grads);
     }
-
-    minibatch.push();
+    // the residuals held back by a sparse push
+    push(minibatch, grads, true);
+    fclose(file);
   }
 
 protected:
-  void learn_instance(Instance &ins, Vec &neu1, Vec &neu1e) noexcept {
+  /**
+   * push the grads of the thread and pull the keys of the next minibatch
+   *
+   * @param times the time of each phase is written to
+   * @param end end of the chunk in training, -1 if not in the chunk mode
+   */
+  void sync(MiniBatchT &minibatch, grad_buffer_t &grads, FILE *file,
+            int &line_id, int batchsize, BatchTimes &times,
+            long long end = -1) {
+    Timer timer;
+    timer.start();
+    if (_fuse_push_pull) {
+      minibatch.push_pull(file, line_id, batchsize, 3, grads, end);
+      times.push = timer.elapsed_ms();
+      return;
+    }
+    push(minibatch, grads);
+    times.push = timer.elapsed_ms();
+    timer.start();
+    minibatch.gather_keys(file, line_id, batchsize, 3, end);
+    times.gather = timer.elapsed_ms();
+    timer.start();
+    pull(minibatch);
+    times.pull = timer.elapsed_ms();
+  }
+  /**
+   * @param flush the last push of a thread, the residuals of a sparse
+   * push are sent as well
+   */
+  void push(MiniBatchT &minibatch, grad_buffer_t &grads,
+            bool flush = false) {
+    if (_combiner)
+      minibatch.push(grads, *_combiner);
+    else
+      minibatch.push(grads, flush);
+    if (_shared_cache)
+      minibatch.release(*_shared_cache);
+  }
+  void pull(MiniBatchT &minibatch) {
+    if (_shared_cache)
+      minibatch.pull(*_shared_cache);
+    else
+      minibatch.pull();
+  }
+
+  /**
+   * grads are written to the buffer of the thread
+   */
+  void learn_instance(Instance &ins, Vec &neu1, Vec &neu1e,
+                      grad_buffer_t &grads) noexcept {
     // neu1.clear(); neu1e.clear();
     int a, c, b = global_random()() % _window;
     int sent_length = ins.words.size();
     int pos = 0;
     int label;
     float g, f;
-    w2v_key_t word, target, last_word;
+    w2v_key_t word;
+    int target_slot, last_slot;
 
     for (pos = 0; pos < sent_length; pos++) {
       word = ins.words[pos];
@@ -673,25 +720,27 @@ protected:
           c = pos - _window + a;
           if (c < 0 || c >= sent_length)
             continue;
-          last_word = ins.words[c];
-          Vec &syn0_lastword = _minibatch.param().params()[last_word].v;
-          neu1 += syn0_lastword;
+          last_slot = ins.slots[c];
+          if (last_slot < 0)
+            continue;
+          neu1 += _param_cache.param(last_slot).v;
         }
       }
       for (int d = 0; d < _negative + 1; d++) {
         if (d == 0) {
-          target = word;
+          target_slot = ins.slots[pos];
           label = 1;
           // generate negative samples
         } else {
-          target = _minibatch.table()[(global_random()() >> 16) % table_size];
-          if (target == 0)
-            target = _minibatch.table()[(global_random()() >> 16) % table_size];
-          if (target == word)
+          target_slot = _minibatch.slot_table()[(global_random()() >> 16) %
+                                                table_size];
+          if (target_slot == ins.slots[pos])
             continue;
           label = 0;
         }
-        Vec &syn1neg_target = _minibatch.param().params()[target].h;
+        if (target_slot < 0)
+          continue;
+        Vec &syn1neg_target = _param_cache.param(target_slot).h;
         f = 0;
         f += neu1.dot(syn1neg_target);
         if (f > MAX_EXP)
@@ -702,7 +751,9 @@ protected:
           g = (label - exptable(f)) * _alpha;
         _error.accu(10000 * g * g);
         neu1e += g * syn1neg_target;
-        _minibatch.param().grads()[target].accu_h(g * neu1);
+        grads.grad(target_slot).accu_h(g * neu1);
+        if (_local_sgd)
+          syn1neg_target += g * neu1;
       }
       // hidden -> in
       for (a = b; a < _window * 2 + 1 - b; a++) {
@@ -710,9 +761,12 @@ protected:
           c = pos - _window + a;
           if (c < 0 || c >= sent_length)
             continue;
-          last_word = ins.words[c];
-          Vec &syn0_lastword = _minibatch.param().params()[last_word].v;
-          _minibatch.param().grads()[last_word].accu_v(neu1e);
+          last_slot = ins.slots[c];
+          if (last_slot < 0)
+            continue;
+          grads.grad(last_slot).accu_v(neu1e);
+          if (_local_sgd)
+            _param_cache.param(last_slot).v += neu1e;
         }
       }
     }
@@ -740,9 +794,25 @@ protected:
   float _sample;
   int nlines;
   std::unordered_set<w2v_key_t> _local_keys;
+  // rows of all the local words, mapped to slots once
   typename MiniBatchT::param_cache_t _param_cache;
   MiniBatchT _minibatch;
   float _alpha; // learning rate
+  // push a minibatch and pull the next in one request
+  bool _fuse_push_pull;
+  // stale synchronous mode, a clock for each thread
+  SSPClock _clock;
+  // grads are applied to the local cache between syncs
+  bool _local_sgd;
+  // merges the pushes of all the threads, null if not enabled
+  std::unique_ptr<push_combiner_t> _combiner;
+  // deduplicates the pulls of all the threads, null if not enabled
+  std::unique_ptr<shared_cache_t> _shared_cache;
+  // hands out the chunks of the dataset, null to train on the local
+  // file split by threads
+  std::unique_ptr<ChunkQueue> _chunks;
+  // iterations finished
+  int _epoch = 0;
   // MiniBatchT _minibatch;
   Error _error;
 }; // end class Word2Vec
@@ -0,0 +1,243 @@
+#pragma once
+#include "../../swiftmpi.h"
+using namespace swift_snails;
+// parameter types shared by word2vec, word2vec_local and sent2vec
+/**
+ * parameter vector's dimention
+ */
+int len_vec() {
+  static int _len_vec = 0;
+  if (_len_vec == 0) {
+    _len_vec = global_config().get("word2vec", "len_vec").to_int32();
+    CHECK_GT(_len_vec, 0);
+  }
+  return _len_vec;
+}
+
+bool &to_output_sent() {
+  static bool _status = false;
+  return _status;
+}
+/**
+ * grads are pushed as sums rather than averages, in the local SGD mode
+ * the local cache has applied every grad since the last sync
+ */
+bool &to_push_grad_sum() {
+  static bool _status = false;
+  return _status;
+}
+/**
+ * words will be std::hash-ed to size_t
+ */
+typedef size_t w2v_key_t;
+/**
+ * Word2Vec Server-side parameter type
+ */
+struct WParam {
+  Vec h, v, h2sum, v2sum;
+  // sentence vector or not
+  // used in sent2vec
+  bool is_sent = false;
+
+  WParam() {
+    h.init(len_vec());
+    h.random();
+    v.init(len_vec());
+    v.random();
+    h2sum.init(len_vec());
+    v2sum.init(len_vec());
+  }
+};
+/**
+ * Local parameter type
+ */
+struct WLocalParam {
+  Vec h, v;
+
+  WLocalParam() {
+    h.init(len_vec());
+    v.init(len_vec());
+  }
+};
+/**
+ * Local gradient type
+ */
+struct WLocalGrad {
+  Vec h_grad, v_grad;
+  int h_count = 0, v_count = 0;
+  // sentence vector or not
+  // used in sent2vec
+  bool is_sent = false;
+
+  WLocalGrad() {
+    h_grad.init(len_vec());
+    v_grad.init(len_vec());
+    h_count = 0;
+    v_count = 0;
+  }
+
+  void accu_h(const Vec &grad) {
+    h_count++;
+    h_grad += grad;
+  }
+
+  void accu_v(const Vec &grad) {
+    v_count++;
+    v_grad += grad;
+  }
+
+  void reset() {
+    h_grad.clear();
+    v_grad.clear();
+    h_count = 0;
+    v_count = 0;
+  }
+  /**
+   * add another grad, used by the push combiner and the hot key cache
+   */
+  void merge(const WLocalGrad &other) {
+    h_grad += other.h_grad;
+    v_grad += other.v_grad;
+    h_count += other.h_count;
+    v_count += other.v_count;
+    is_sent = is_sent || other.is_sent;
+  }
+
+  /**
+   * L2 norm of the averaged grads, used by sparse push
+   */
+  float magnitude() const {
+    double sum = 0;
+    if (h_count > 0)
+      sum += h_grad.dot(h_grad) / (double(h_count) * h_count);
+    if (v_count > 0)
+      sum += v_grad.dot(v_grad) / (double(v_count) * v_count);
+    return std::sqrt(sum);
+  }
+
+  void norm() {
+    if (h_count > 0)
+      h_grad /= static_cast<float>(h_count);
+    if (v_count > 0)
+      h_grad /= static_cast<float>(v_count);
+  }
+};
+
+std::ostream &operator<<(std::ostream &os, const WParam &param) {
+  if (param.is_sent == to_output_sent()) {
+    for (int i = 0; i < len_vec() - 1; i++)
+      os << param.v[i] << " ";
+    os << param.v[len_vec() - 1] << "\t";
+    for (int i = 0; i < len_vec() - 1; i++)
+      os << param.h[i] << " ";
+    os << param.h[len_vec() - 1];
+  }
+  return os;
+}
+std::istream &operator>>(std::istream &is, WParam &param) {
+  for (int i = 0; i < len_vec(); i++) {
+    is >> param.v[i];
+  }
+  for (int i = 0; i < len_vec(); i++) {
+    is >> param.h[i];
+  }
+  return is;
+}
+BinaryBuffer &operator<<(BinaryBuffer &bb, WLocalGrad &grad) {
+  // CHECK_GT (grad.count, 0);
+  bb << grad.is_sent;
+  if (grad.h_count > 0 && !to_push_grad_sum())
+    grad.h_grad /= grad.h_count;
+  if (grad.v_count > 0 && !to_push_grad_sum())
+    grad.v_grad /= grad.v_count;
+  for (int i = 0; i < len_vec(); i++) {
+    bb << grad.h_grad[i];
+    bb << grad.v_grad[i];
+  }
+  return bb;
+}
+BinaryBuffer &operator>>(BinaryBuffer &bb, WLocalGrad &grad) {
+  bb >> grad.is_sent;
+  for (int i = 0; i < len_vec(); i++) {
+    bb >> grad.h_grad[i];
+    bb >> grad.v_grad[i];
+  }
+  // grads are averaged before sent unless summed, merged ones are averaged
+  grad.h_count = 1;
+  grad.v_count = 1;
+  return bb;
+}
+/**
+ * whole server-side row, used when a fragment moves to another server
+ */
+BinaryBuffer &operator<<(BinaryBuffer &bb, WParam &param) {
+  bb << param.is_sent;
+  for (int i = 0; i < len_vec(); i++) {
+    bb << param.h[i];
+    bb << param.v[i];
+    bb << param.h2sum[i];
+    bb << param.v2sum[i];
+  }
+  return bb;
+}
+BinaryBuffer &operator>>(BinaryBuffer &bb, WParam &param) {
+  bb >> param.is_sent;
+  for (int i = 0; i < len_vec(); i++) {
+    bb >> param.h[i];
+    bb >> param.v[i];
+    bb >> param.h2sum[i];
+    bb >> param.v2sum[i];
+  }
+  return bb;
+}
+BinaryBuffer &operator<<(BinaryBuffer &bb, WLocalParam &param) {
+  for (int i = 0; i < len_vec(); i++) {
+    bb << param.h[i];
+    bb << param.v[i];
+  }
+  return bb;
+}
+BinaryBuffer &operator>>(BinaryBuffer &bb, WLocalParam &param) {
+  for (int i = 0; i < len_vec(); i++) {
+    bb >> param.h[i];
+    bb >> param.v[i];
+  }
+  return bb;
+}
+
+class WPullAccessMethod
+    : public PullAccessMethod<w2v_key_t, WParam, WLocalParam> {
+public:
+  virtual void init_param(const w2v_key_t &key, param_t &param) {}
+  virtual void get_pull_value(const w2v_key_t &key, const param_t &param,
+                              pull_t &val) noexcept {
+    val.h = param.h;
+    val.v = param.v;
+  }
+};
+
+class WPushAccessMethod
+    : public PushAccessMethod<w2v_key_t, WParam, WLocalGrad> {
+public:
+  WPushAccessMethod()
+      : initial_learning_rate(
+            global_config().get("server", "initial_learning_rate").to_float()) {
+  }
+  virtual void apply_push_value(const w2v_key_t &key, param_t &param,
+                                const grad_t &push_val) noexcept {
+    // LOG (INFO) << "apply push  " << key << "  param:" << param << "grad  " <<
+    // push_val.h_grad << "  " << push_val.v_grad;
+    param.is_sent = push_val.is_sent;
+    param.h2sum += push_val.h_grad * push_val.h_grad;
+    param.v2sum += push_val.v_grad * push_val.v_grad;
+    param.h += initial_learning_rate * push_val.h_grad /
+               (swift_snails::sqrt(param.h2sum + fudge_factor));
+    param.v += initial_learning_rate * push_val.v_grad /
+               (swift_snails::sqrt(param.v2sum + fudge_factor));
+  }
+
+private:
+  float initial_learning_rate;
+  static const float fudge_factor;
+};
+const float WPushAccessMethod::fudge_factor = 1e-6;
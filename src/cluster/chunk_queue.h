@@ -0,0 +1,96 @@
+#pragma once
+#include "../utils/all.h"
+#include "../transfer/transfer.h"
+#include "message_classes.h"
+#include "worker.h"
+namespace swift_snails {
+/**
+ * @brief chunks of the dataset handed out on demand
+ *
+ * the dataset is split into byte ranges of `chunk_bytes`, the first
+ * server hands them out to the threads of every worker as they ask, so
+ * the fast ones train on more chunks and an epoch ends when all the
+ * chunks are taken.
+ *
+ * @warning the file of every worker should be the same, shared or
+ * replicated
+ */
+class ChunkQueue : public VirtualObject {
+public:
+  ChunkQueue(const std::string &path, long long chunk_bytes)
+      : _chunk_bytes(chunk_bytes), gtransfer(global_worker().transfer()) {
+    CHECK_GT(_chunk_bytes, 0);
+    FILE *file = fopen(path.c_str(), "rb");
+    CHECK(file) << "no such file or directory: " << path;
+    fseek(file, 0, SEEK_END);
+    _file_size = ftell(file);
+    fclose(file);
+    _num_chunks = count_chunks(_file_size, _chunk_bytes);
+  }
+  /**
+   * @brief take the byte range of the next chunk of an epoch
+   *
+   * @return false if all the chunks of the epoch are taken
+   */
+  bool next(int epoch, long long &begin, long long &end) {
+    const auto &server_ids = global_route().server_ids();
+    CHECK(!server_ids.empty());
+    int chunk = -1;
+    StateBarrier barrier;
+    Request req;
+    req.meta.message_class = WORKER_FETCH_CHUNK;
+    req.cont << epoch;
+    req.cont << _num_chunks;
+    req.call_back_handler = [&barrier, &chunk](std::shared_ptr<Request> rsp) {
+      rsp->cont >> chunk;
+      barrier.set_state_valid();
+      barrier.try_unblock();
+    };
+    gtransfer.send(std::move(req), server_ids[0]);
+    barrier.block();
+    if (chunk < 0)
+      return false;
+    chunk_range(chunk, _chunk_bytes, _file_size, begin, end);
+    return true;
+  }
+  // number of chunks of `chunk_bytes` a file is split into
+  static int count_chunks(long long file_size, long long chunk_bytes) {
+    return (file_size + chunk_bytes - 1) / chunk_bytes;
+  }
+  /**
+   * @brief byte range [begin, end) of a chunk, the last one is cut at
+   * the end of the file
+   */
+  static void chunk_range(int chunk, long long chunk_bytes,
+                          long long file_size, long long &begin,
+                          long long &end) {
+    begin = chunk * chunk_bytes;
+    end = std::min(begin + chunk_bytes, file_size);
+  }
+  /**
+   * @brief seek to the first line that starts in a chunk
+   *
+   * a line belongs to the chunk it starts in, the line cut by `begin` is
+   * skipped
+   */
+  static void seek(FILE *file, long long begin) {
+    if (begin == 0) {
+      fseek(file, 0, SEEK_SET);
+      return;
+    }
+    fseek(file, begin - 1, SEEK_SET);
+    int c;
+    while ((c = fgetc(file)) != EOF && c != '\n')
+      ;
+  }
+
+  int num_chunks() const { return _num_chunks; }
+
+private:
+  long long _chunk_bytes;
+  long long _file_size = 0;
+  int _num_chunks = 0;
+  Transfer<ServerWorkerRoute> &gtransfer;
+}; // end class ChunkQueue
+
+}; // end namespace swift_snails
@@ -24,9 +24,31 @@ public:
     CHECK_GT(_worker_num, 0);
   }
 
+  ~Cluster() { stop_migrate_thread(); }
+
   void initialize() {
     init_route();
     init_hashfrag();
+    init_update_hashfrag_method();
+    start_migrate_thread();
+  }
+  /**
+   * @brief move fragments to other servers while the job runs
+   *
+   * the owner of a fragment holds its requests, sends its rows to the new
+   * owner and routes the fragment to it once they land, then every worker
+   * gets the moves. The old owner keeps forwarding the requests of the
+   * workers with an older hashfrag.
+   *
+   * @param moves new owner of each fragment to move
+   * @warning should be called by a single worker, the master, at a time
+   */
+  void migrate_frags(const std::map<int, int> &moves) {
+    auto &hashfrag = global_hashfrag<KeyT>();
+    std::vector<int> owners(hashfrag.num_frags());
+    for (int i = 0; i < hashfrag.num_frags(); i++)
+      owners[i] = hashfrag.frag_node(i);
+    move_frags(moves, owners);
   }
   /**
    * @brief cluster finish working
@@ -39,6 +61,7 @@ public:
    * * tell all Workers to exit
    */
   void finalize(const std::string &path = "") {
+    stop_migrate_thread();
     global_mpi().barrier();
     // TODO tell workers to exit
     _worker.finalize();
@@ -62,41 +85,53 @@ protected:
    */
   void init_route() {
     LOG(INFO) << "init global route ...";
-    _ports.assign(global_mpi().size() * 2, 0);
-    //_ports.assign(_server_num + _worker_num, 0);
+    // every service thread of worker and server listens to its own port
+    // all the nodes share the same config, so the number of ports is fixed
+    // the MPI transport has no port and nodes are reached by rank
+    const auto &worker_ports = _worker.transfer().recv_ports();
+    const auto &server_ports = _server.transfer().recv_ports();
+    const int num_worker_ports = worker_ports.size();
+    const int num_server_ports = server_ports.size();
+    const int num_ports = num_worker_ports + num_server_ports;
+    _ports.assign(global_mpi().size() * num_ports, 0);
     // distribute port
-    _ports[global_mpi().rank() * 2] =
-        _worker.transfer().recv_port(); // worker's port
-    _ports[global_mpi().rank() * 2 + 1] =
-        _server.transfer().recv_port(); // server's port
     const int local_rank = global_mpi().rank();
-    /*
-    if (to_start_server(local_rank))
-        _ports[local_rank] = _server.transfer().recv_port();
-    if (to_start_worker(local_rank))
-        _ports[_server_num + _worker_num - local_rank - 1] =
-    _worker.transfer().recv_port();
-    */
-    CHECK(0 == MPI_Allgather(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, &_ports[0], 2,
-                             MPI_INT, MPI_COMM_WORLD));
+    if (num_ports > 0) {
+      std::copy(worker_ports.begin(), worker_ports.end(),
+                _ports.begin() + local_rank * num_ports); // worker's ports
+      std::copy(server_ports.begin(), server_ports.end(),
+                _ports.begin() + local_rank * num_ports +
+                    num_worker_ports); // server's ports
+      CHECK(0 == MPI_Allgather(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, &_ports[0],
+                               num_ports, MPI_INT, MPI_COMM_WORLD));
+    }
     int server_id, worker_id;
+    std::vector<int> worker_ids(global_mpi().size(), -1);
     // init global route
     for (int rank = 0; rank < global_mpi().size(); rank++) {
       worker_id = server_id = -1;
       std::string ip =
           std::string(global_mpi().ip(rank), global_mpi().IP_WIDTH);
-      int worker_port = _ports[rank * 2];
-      int server_port = _ports[rank * 2 + 1];
-      std::string worker_addr, server_addr;
-      format_string(worker_addr, "tcp://%s:%d", ip.c_str(), worker_port);
-      format_string(server_addr, "tcp://%s:%d", ip.c_str(), server_port);
-      LOG(INFO) << "worker_addr:\t" << worker_addr;
-      LOG(INFO) << "server_addr:\t" << server_addr;
+      std::vector<std::string> worker_addrs, server_addrs;
+      for (int i = 0; i < num_ports; i++) {
+        std::string addr;
+        format_string(addr, "tcp://%s:%d", ip.c_str(),
+                      _ports[rank * num_ports + i]);
+        if (i < num_worker_ports) {
+          LOG(INFO) << "worker_addr:\t" << addr;
+          worker_addrs.push_back(std::move(addr));
+        } else {
+          LOG(INFO) << "server_addr:\t" << addr;
+          server_addrs.push_back(std::move(addr));
+        }
+      }
       if (to_start_worker(local_rank))
-        worker_id =
-            global_route().register_node_(false, std::move(worker_addr));
+        worker_id = global_route().register_node_(false, rank,
+                                                  std::move(worker_addrs));
+      worker_ids[rank] = worker_id;
       if (to_start_server(local_rank))
-        server_id = global_route().register_node_(true, std::move(server_addr));
+        server_id = global_route().register_node_(true, rank,
+                                                  std::move(server_addrs));
       if (rank == local_rank) {
         DLOG(WARNING) << "init local client_id:\t" << worker_id << "\t"
                       << server_id;
@@ -104,10 +139,32 @@ protected:
           global_worker().transfer().set_client_id(worker_id);
         if (to_start_worker(rank))
           global_server<ServerT>().transfer().set_client_id(server_id);
+        // worker and server of the same rank talk without the network
+        if (worker_id >= 0 && server_id >= 0) {
+          _worker.transfer().set_local_peer(server_id, &_server.transfer());
+          _server.transfer().set_local_peer(worker_id, &_worker.transfer());
+        }
       }
     }
+    init_host_leader(worker_ids);
     global_mpi().barrier();
   }
+  /**
+   * workers on a host pull and push through the worker of the lowest
+   * rank on it if host aggregation is enabled
+   */
+  void init_host_leader(const std::vector<int> &worker_ids) {
+    if (global_config().get("cluster", "host_aggregation", "0").to_int32() <= 0)
+      return;
+    const int local_rank = global_mpi().rank();
+    const int leader = global_mpi().host_leader(local_rank);
+    if (leader == local_rank || worker_ids[leader] < 0 ||
+        worker_ids[local_rank] < 0)
+      return;
+    LOG(WARNING) << "pull and push through the host aggregator of rank "
+                 << leader;
+    _worker.set_host_leader(worker_ids[leader]);
+  }
 
   bool to_start_server(int id) {
     CHECK_GE(id, 0);
@@ -129,6 +186,188 @@ protected:
 
     global_mpi().barrier();
   }
+  /**
+   * workers take the moves of fragments of a migration, the older
+   * versions are dropped
+   */
+  void init_update_hashfrag_method() {
+    ClusterWorker::transfer_t::msgcls_handler_t handler = [](
+        std::shared_ptr<Request> req, Request &rsp) {
+      int version, num_moves;
+      req->cont >> version;
+      req->cont >> num_moves;
+      std::map<int, int> moves;
+      for (int i = 0; i < num_moves; i++) {
+        int frag_id, node_id;
+        req->cont >> frag_id;
+        req->cont >> node_id;
+        moves[frag_id] = node_id;
+      }
+      global_hashfrag<KeyT>().update(version, moves);
+      rsp.cont << true;
+    };
+    _worker.transfer().message_class().add(NODE_UPDATE_HASHFRAG,
+                                           std::move(handler));
+  }
+  /**
+   * @param owners node of each fragment, the moves to the owner are
+   * dropped
+   */
+  void move_frags(const std::map<int, int> &moves,
+                  const std::vector<int> &owners) {
+    std::map<int, std::vector<std::pair<int, int>>> owner_moves;
+    std::map<int, int> real_moves;
+    for (const auto &move : moves) {
+      int owner = owners[move.first];
+      if (owner == move.second)
+        continue;
+      owner_moves[owner].push_back(move);
+      real_moves.insert(move);
+    }
+    if (owner_moves.empty())
+      return;
+    // the owners move the rows first
+    send_and_wait(owner_moves.size(), [&](voidf_t callback) {
+      for (auto &item : owner_moves) {
+        Request req;
+        req.meta.message_class = MASTER_MIGRATE_FRAGS;
+        req.cont << (int)item.second.size();
+        for (const auto &move : item.second) {
+          req.cont << move.first;
+          req.cont << move.second;
+        }
+        req.call_back_handler = [callback](std::shared_ptr<Request>) {
+          callback();
+        };
+        _worker.transfer().send(std::move(req), item.first);
+      }
+    });
+    // then the workers route the fragments to the new owners
+    const int version = global_hashfrag<KeyT>().version() + 1;
+    const auto &worker_ids = global_route().worker_ids();
+    send_and_wait(worker_ids.size(), [&](voidf_t callback) {
+      for (int node_id : worker_ids) {
+        Request req;
+        req.meta.message_class = NODE_UPDATE_HASHFRAG;
+        req.cont << version;
+        req.cont << (int)real_moves.size();
+        for (const auto &move : real_moves) {
+          req.cont << move.first;
+          req.cont << move.second;
+        }
+        req.call_back_handler = [callback](std::shared_ptr<Request>) {
+          callback();
+        };
+        _worker.transfer().send(std::move(req), node_id);
+      }
+    });
+    LOG(WARNING) << "hashfrag version " << version << ", "
+                 << real_moves.size() << " fragments moved";
+  }
+  /**
+   * @brief move fragments from the most accessed servers to the least
+   * accessed ones
+   *
+   * the servers report the accesses of the fragments they serve since the
+   * last report.
+   */
+  void rebalance_frags(double max_skew, int max_moves) {
+    auto &hashfrag = global_hashfrag<KeyT>();
+    std::vector<double> frag_loads(hashfrag.num_frags(), 0);
+    // a fragment is served by the server that reports it
+    std::vector<int> owners(hashfrag.num_frags(), 0);
+    std::mutex loads_mut;
+    const auto &server_ids = global_route().server_ids();
+    send_and_wait(server_ids.size(), [&](voidf_t callback) {
+      for (int node_id : server_ids) {
+        Request req;
+        req.meta.message_class = MASTER_FRAG_LOADS;
+        req.cont << true;
+        req.call_back_handler = [&, node_id, callback](
+            std::shared_ptr<Request> rsp) {
+          int num_frags;
+          rsp->cont >> num_frags;
+          std::lock_guard<std::mutex> lk(loads_mut);
+          for (int i = 0; i < num_frags; i++) {
+            int frag_id;
+            size_t load;
+            rsp->cont >> frag_id;
+            rsp->cont >> load;
+            frag_loads[frag_id] += load;
+            owners[frag_id] = node_id;
+          }
+          callback();
+        };
+        _worker.transfer().send(std::move(req), node_id);
+      }
+    });
+    std::vector<double> node_loads(hashfrag.num_nodes(), 0);
+    for (int i = 0; i < hashfrag.num_frags(); i++)
+      if (owners[i] > 0)
+        node_loads[owners[i] - 1] += frag_loads[i];
+    auto moves = BasicHashFrag<KeyT>::plan_moves(
+        owners, frag_loads, hashfrag.num_nodes(), max_skew, max_moves);
+    if (moves.empty())
+      return;
+    LOG(WARNING) << "server load skew (max/mean):\t" << load_skew(node_loads)
+                 << ", move " << moves.size() << " fragments";
+    move_frags(moves, owners);
+  }
+  /**
+   * the master moves fragments every `frag_migrate_ms` while the load
+   * skew of the servers is over `frag_migrate_skew`
+   */
+  void start_migrate_thread() {
+    const int period_ms =
+        global_config().get("cluster", "frag_migrate_ms", "0").to_int32();
+    if (period_ms <= 0)
+      return;
+    if (global_config().get("worker", "bsp_exchange", "0").to_int32() > 0) {
+      LOG(WARNING) << "fragments are not moved with bsp_exchange";
+      return;
+    }
+    // the last rank always runs a worker
+    if (global_mpi().rank() != global_mpi().size() - 1)
+      return;
+    const double max_skew =
+        global_config().get("cluster", "frag_migrate_skew", "1.2").to_float();
+    const int max_moves = global_config()
+                              .get("cluster", "frag_migrate_max_moves", "16")
+                              .to_int32();
+    CHECK_GE(max_skew, 1);
+    CHECK_GT(max_moves, 0);
+    _migrate_thread = std::thread([this, period_ms, max_skew, max_moves] {
+      std::unique_lock<std::mutex> lk(_migrate_mut);
+      while (!_migrate_cv.wait_for(lk, std::chrono::milliseconds(period_ms),
+                                   [this] { return _to_stop_migrate; }))
+        rebalance_frags(max_skew, max_moves);
+    });
+  }
+  // waits for the migration in progress
+  void stop_migrate_thread() {
+    {
+      std::lock_guard<std::mutex> lk(_migrate_mut);
+      _to_stop_migrate = true;
+    }
+    _migrate_cv.notify_all();
+    if (_migrate_thread.joinable())
+      _migrate_thread.join();
+  }
+  /**
+   * @brief call `send(callback)` and block until `callback` is called
+   * `num_reqs` times
+   */
+  void send_and_wait(size_t num_reqs, std::function<void(voidf_t)> send) {
+    StateBarrier barrier;
+    std::atomic<size_t> num_left{num_reqs};
+    send([&barrier, &num_left] {
+      if (--num_left == 0) {
+        barrier.set_state_valid();
+        barrier.try_unblock();
+      }
+    });
+    barrier.block();
+  }
 
 private:
   WorkerT &_worker;
@@ -137,6 +376,11 @@ private:
   int _server_num;
   int _worker_num;
   bool _to_split_worker_server{false};
+  // moves fragments on the master, not started if disabled
+  std::thread _migrate_thread;
+  std::mutex _migrate_mut;
+  std::condition_variable _migrate_cv;
+  bool _to_stop_migrate = false;
 }; // end class Cluster
 
 }; // end namespace swift_snails
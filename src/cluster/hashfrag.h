@@ -7,9 +7,25 @@ namespace swift_snails {
  */
 uint64_t hash_fn(uint64_t x) { return get_hash_code(x); }
 
+/**
+ * \brief load of the most loaded node over the mean
+ */
+inline double load_skew(const std::vector<double> &loads) {
+  double total = 0, largest = 0;
+  for (double load : loads) {
+    total += load;
+    largest = std::max(largest, load);
+  }
+  return total > 0 ? largest * loads.size() / total : 1;
+}
+
 /**
  * \brief Basic Hash Fragment
  *
+ * the map of fragments to nodes is versioned, a change builds a new map
+ * and swaps it in atomically, so readers see either map whole. The old
+ * maps are kept for the readers still holding them.
+ *
  * \warning without Replication, Fault Tolerance and Repair
  */
 template <typename Key> class BasicHashFrag : public VirtualObject {
@@ -30,29 +46,152 @@ public:
    * and should be called by *Master Server*
    * the worker nodes should not call it
    */
-  void init() {
+  void init() { init(global_config().get("server", "frag_num").to_int32()); }
+  void init(int num_frags) {
     CHECK(num_nodes() > 0);
-    // num_nodes = global_config().register_config("init_node_num").to_int32();
-    _num_frags = global_config().get("server", "frag_num").to_int32();
-    _map_table.reset(new index_t[num_frags()]);
+    CHECK_GT(num_frags, 0);
+    std::lock_guard<std::mutex> lk(_update_mut);
+    _num_frags = num_frags;
+    std::unique_ptr<index_t[]> table(new index_t[num_frags]);
     // divide the fragments
-    int num_frag_each_node = int(num_frags() / num_nodes());
-    for (int i = 0; i < num_frags(); i++) {
+    int num_frag_each_node = std::max(1, num_frags / num_nodes());
+    for (int i = 0; i < num_frags; i++) {
       // skip case: node_id=0 which is master's id
       int id = index_t(i / num_frag_each_node) + 1;
       if (id < 1)
         id = 1;
       if (id > num_nodes())
         id = num_nodes();
-      _map_table[i] = id;
+      table[i] = id;
     }
+    publish(std::move(table));
   }
 
-  int to_node_id(const key_t &key) {
-    CHECK(_map_table) << "map_table has not been inited";
-    int frag_id = hash_fn(key) % num_frags();
-    int node_id = _map_table[frag_id];
-    return node_id;
+  int to_node_id(const key_t &key) const { return frag_node(frag_id(key)); }
+
+  int frag_id(const key_t &key) const { return hash_fn(key) % num_frags(); }
+  int frag_node(int frag_id) const {
+    const index_t *table = _map_table.load(std::memory_order_acquire);
+    CHECK(table) << "map_table has not been inited";
+    return table[frag_id];
+  }
+  /**
+   * \brief version of the map, increased by every migration
+   */
+  int version() const { return _version; }
+  /**
+   * \brief move fragments to other nodes while the job runs
+   *
+   * \param moves new node of each fragment moved
+   * \return false if the map is at `version` or newer already, and the
+   * moves are dropped
+   */
+  bool update(int version, const std::map<int, int> &moves) {
+    std::lock_guard<std::mutex> lk(_update_mut);
+    if (version <= _version)
+      return false;
+    std::unique_ptr<index_t[]> table = copy_table();
+    for (const auto &move : moves) {
+      CHECK(move.first >= 0 && move.first < num_frags());
+      CHECK(move.second >= 1 && move.second <= num_nodes());
+      table[move.first] = move.second;
+    }
+    publish(std::move(table));
+    _version = version;
+    return true;
+  }
+  /**
+   * \brief reassign the fragments to balance the expected load of nodes
+   *
+   * fragments are taken from the heaviest, each to the node with the
+   * least load so far (LPT). Every fragment counts one more than its
+   * load, so the fragments of unseen keys are spread as well.
+   *
+   * \param frag_loads expected load of each fragment
+   * \warning every node should rebalance with the same loads, before
+   * any parameter is pulled
+   */
+  void rebalance(const std::vector<double> &frag_loads) {
+    CHECK_EQ((int)frag_loads.size(), num_frags());
+    std::lock_guard<std::mutex> lk(_update_mut);
+    std::unique_ptr<index_t[]> table = copy_table();
+    std::vector<int> order(num_frags());
+    for (int i = 0; i < num_frags(); i++)
+      order[i] = i;
+    // ties are broken by fragment id to be the same on every node
+    std::sort(order.begin(), order.end(), [&frag_loads](int a, int b) {
+      return frag_loads[a] > frag_loads[b] ||
+             (frag_loads[a] == frag_loads[b] && a < b);
+    });
+    typedef std::pair<double, int> load_node_t;
+    std::priority_queue<load_node_t, std::vector<load_node_t>,
+                        std::greater<load_node_t>>
+        nodes;
+    for (int id = 1; id <= num_nodes(); id++)
+      nodes.emplace(0, id);
+    for (int frag : order) {
+      load_node_t node = nodes.top();
+      nodes.pop();
+      table[frag] = node.second;
+      node.first += frag_loads[frag] + 1;
+      nodes.push(node);
+    }
+    publish(std::move(table));
+  }
+  /**
+   * \brief plan moves of fragments to bring the node load skew under
+   * `max_skew`
+   *
+   * each move takes the fragment of the heaviest node whose load is
+   * closest to half the gap to the lightest node, fragments of no load
+   * are left.
+   *
+   * \param owners node of each fragment, 0 if unknown
+   * \param frag_loads load of each fragment
+   * \return new node of each fragment to move
+   */
+  static std::map<int, int> plan_moves(std::vector<int> owners,
+                                       const std::vector<double> &frag_loads,
+                                       int num_nodes, double max_skew,
+                                       int max_moves) {
+    CHECK_EQ(owners.size(), frag_loads.size());
+    std::vector<double> loads(num_nodes, 0);
+    for (size_t i = 0; i < owners.size(); i++)
+      if (owners[i] > 0)
+        loads[owners[i] - 1] += frag_loads[i];
+    std::map<int, int> moves;
+    while ((int)moves.size() < max_moves && load_skew(loads) > max_skew) {
+      auto range = std::minmax_element(loads.begin(), loads.end());
+      int light = range.first - loads.begin() + 1;
+      int heavy = range.second - loads.begin() + 1;
+      double gap = loads[heavy - 1] - loads[light - 1];
+      // a fragment of no less than the gap would not lower the maximum
+      int best = -1;
+      for (size_t i = 0; i < owners.size(); i++) {
+        if (owners[i] != heavy || frag_loads[i] <= 0 || frag_loads[i] >= gap)
+          continue;
+        if (best < 0 || std::abs(frag_loads[i] - gap / 2) <
+                            std::abs(frag_loads[best] - gap / 2))
+          best = i;
+      }
+      if (best < 0)
+        break;
+      owners[best] = light;
+      loads[heavy - 1] -= frag_loads[best];
+      loads[light - 1] += frag_loads[best];
+      moves[best] = light;
+    }
+    return moves;
+  }
+  /**
+   * \brief expected load of each node, indexed by node id - 1
+   */
+  std::vector<double> node_loads(const std::vector<double> &frag_loads) const {
+    CHECK_EQ((int)frag_loads.size(), num_frags());
+    std::vector<double> loads(num_nodes(), 0);
+    for (int i = 0; i < num_frags(); i++)
+      loads[frag_node(i) - 1] += frag_loads[i];
+    return loads;
   }
 
   void serialize(BinaryBuffer &bb) const {
@@ -60,7 +199,7 @@ public:
     bb << num_frags();
 
     for (int i = 0; i < num_frags(); i++) {
-      bb << _map_table[i];
+      bb << (index_t)frag_node(i);
     }
   }
 
@@ -71,20 +210,16 @@ public:
     CHECK_GT(num_frags_, 0);
     DLOG(INFO) << "deserialize hashfrag\tnum_nodes\t" << num_nodes_
                << "\tnum_frags\t" << num_frags_;
-    CHECK((_map_table && (num_frags_ == num_frags())) || (!_map_table));
+    std::lock_guard<std::mutex> lk(_update_mut);
+    CHECK(_num_frags == 0 || num_frags_ == _num_frags);
     _num_nodes = num_nodes_;
-    // init maptable
-    if (_num_frags == 0) {
-      CHECK(!_map_table);
-      _num_frags = num_frags_;
-      _map_table.reset(new index_t[num_frags()]);
-    }
-
-    // memory should not been inited
+    _num_frags = num_frags_;
     // the size of the map table will not be changed
+    std::unique_ptr<index_t[]> table(new index_t[num_frags()]);
     for (int i = 0; i < num_frags(); i++) {
-      bb >> _map_table[i];
+      bb >> table[i];
     }
+    publish(std::move(table));
   }
 
   int num_nodes() const { return _num_nodes; }
@@ -97,19 +232,38 @@ public:
                                   BasicHashFrag<key_t> &frag) {
     os << "hash frag" << std::endl;
     for (int i = 0; i < frag.num_frags(); i++) {
-      os << frag._map_table[i] << " ";
+      os << frag.frag_node(i) << " ";
     }
     os << std::endl;
     return os;
   }
 
 private:
+  // a copy of the current map
+  // \warning `_update_mut` should be held
+  std::unique_ptr<index_t[]> copy_table() const {
+    CHECK(!_tables.empty()) << "map_table has not been inited";
+    std::unique_ptr<index_t[]> table(new index_t[num_frags()]);
+    std::copy(_tables.back().get(), _tables.back().get() + num_frags(),
+              table.get());
+    return table;
+  }
+  // \warning `_update_mut` should be held
+  void publish(std::unique_ptr<index_t[]> table) {
+    _map_table.store(table.get(), std::memory_order_release);
+    _tables.push_back(std::move(table));
+  }
+
   int _num_nodes = 0;
   int _num_frags = 0;
+  std::atomic<int> _version{0};
   // record visit frequency
   // std::map<int, NodeVisitFreq> visit_freqs;
   // register config
-  std::unique_ptr<index_t[]> _map_table;
+  std::atomic<const index_t *> _map_table{nullptr};
+  // every version of the map, the last is the current one
+  std::vector<std::unique_ptr<index_t[]>> _tables;
+  std::mutex _update_mut;
 
 }; // class HashFrag
 
@@ -117,5 +271,38 @@ template <class Key> inline BasicHashFrag<Key> &global_hashfrag() {
   static BasicHashFrag<Key> hash;
   return hash;
 }
+/**
+ * \brief rebalance the global hashfrag by the key frequencies of every
+ * rank
+ *
+ * the loads of the fragments are summed over the ranks with
+ * MPI_Allreduce, then every rank rebalances the same way.
+ *
+ * \param key_freqs frequency of each local key
+ * \param sample_rate ratio of keys sampled by hash to estimate the loads
+ * \warning a collective, every rank should call it before any parameter
+ * is pulled
+ */
+template <class Key, class FreqMap>
+void balance_hashfrag(const FreqMap &key_freqs, float sample_rate) {
+  CHECK(sample_rate > 0 && sample_rate <= 1);
+  auto &hashfrag = global_hashfrag<Key>();
+  std::vector<double> local_loads(hashfrag.num_frags(), 0);
+  const uint64_t sample_bound = sample_rate * 10000;
+  for (const auto &item : key_freqs) {
+    // sampled apart from the fragment hash
+    if (get_hash_code(item.first, 2) % 10000 >= sample_bound)
+      continue;
+    local_loads[hashfrag.frag_id(item.first)] += item.second / sample_rate;
+  }
+  std::vector<double> frag_loads(hashfrag.num_frags(), 0);
+  CHECK(0 == MPI_Allreduce(&local_loads[0], &frag_loads[0],
+                           hashfrag.num_frags(), MPI_DOUBLE, MPI_SUM,
+                           MPI_COMM_WORLD));
+  double skew = load_skew(hashfrag.node_loads(frag_loads));
+  hashfrag.rebalance(frag_loads);
+  LOG(WARNING) << "hashfrag node load skew (max/mean):\t" << skew << " -> "
+               << load_skew(hashfrag.node_loads(frag_loads));
+}
 
 }; // end namespace swift_snails
@@ -0,0 +1,116 @@
+#pragma once
+#include "../utils/all.h"
+namespace swift_snails {
+/**
+ * @brief access counter of the keys of a server
+ *
+ * counts are split into lock stripes by key, a request locks each
+ * stripe it touches once.
+ *
+ * @param Key key
+ */
+template <typename Key> class HotKeyCounter : public VirtualObject {
+public:
+  typedef Key key_t;
+
+  /**
+   * @param period_ms counts are ranked and decayed once per this period
+   */
+  explicit HotKeyCounter(int num_stripes = 16, int period_ms = 1000)
+      : _stripes(num_stripes), _period_ms(period_ms) {
+    CHECK_GT(num_stripes, 0);
+    CHECK_GE(period_ms, 0);
+  }
+  /**
+   * @brief count the accesses of keys
+   *
+   * @param counts accesses of each key, one each if empty
+   */
+  void add(const std::vector<key_t> &keys,
+           const std::vector<size_t> &counts = std::vector<size_t>()) {
+    CHECK(counts.empty() || counts.size() == keys.size());
+    std::vector<std::vector<size_t>> stripe_idxs(_stripes.size());
+    for (size_t i = 0; i < keys.size(); i++)
+      stripe_idxs[stripe_of(keys[i])].push_back(i);
+    for (size_t s = 0; s < _stripes.size(); s++) {
+      if (stripe_idxs[s].empty())
+        continue;
+      Stripe &stripe = _stripes[s];
+      std::lock_guard<std::mutex> lk(stripe.mut);
+      for (size_t i : stripe_idxs[s])
+        stripe.counts[keys[i]] += counts.empty() ? 1 : counts[i];
+    }
+  }
+  /**
+   * @brief the `k` most accessed keys, sorted
+   *
+   * the keys are ranked once per period and every call in the period
+   * reads that snapshot. counts are halved after each ranking, so the hot
+   * set follows the recent accesses and cold keys are dropped.
+   */
+  std::vector<key_t> top(size_t k) {
+    std::lock_guard<std::mutex> lk(_snapshot_mut);
+    int64_t now = now_ms();
+    bool to_decay = now - _stamp >= _period_ms;
+    if (to_decay || k != _snapshot_k) {
+      _snapshot = rank(k, to_decay);
+      _snapshot_k = k;
+    }
+    if (to_decay)
+      _stamp = now;
+    return _snapshot;
+  }
+
+private:
+  struct Stripe {
+    std::mutex mut;
+    std::unordered_map<key_t, size_t> counts;
+  };
+
+  size_t stripe_of(const key_t &key) const {
+    return std::hash<key_t>()(key) % _stripes.size();
+  }
+
+  static int64_t now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+  // the `k` most accessed keys, sorted, counts are halved if `to_decay`
+  std::vector<key_t> rank(size_t k, bool to_decay) {
+    std::vector<std::pair<size_t, key_t>> counts;
+    for (auto &stripe : _stripes) {
+      std::lock_guard<std::mutex> lk(stripe.mut);
+      for (auto it = stripe.counts.begin(); it != stripe.counts.end();) {
+        counts.emplace_back(it->second, it->first);
+        if (to_decay)
+          it->second /= 2;
+        if (it->second == 0)
+          it = stripe.counts.erase(it);
+        else
+          ++it;
+      }
+    }
+    k = std::min(k, counts.size());
+    std::vector<key_t> keys;
+    if (k == 0)
+      return keys;
+    std::nth_element(counts.begin(), counts.begin() + (k - 1), counts.end(),
+                     std::greater<std::pair<size_t, key_t>>());
+    keys.reserve(k);
+    for (size_t i = 0; i < k; i++)
+      keys.push_back(counts[i].second);
+    std::sort(keys.begin(), keys.end());
+    return keys;
+  }
+
+  std::vector<Stripe> _stripes;
+  int _period_ms;
+  std::mutex _snapshot_mut;
+  // time of the last decay, the first top() ranks and decays
+  int64_t _stamp = std::numeric_limits<int64_t>::min() / 2;
+  std::vector<key_t> _snapshot;
+  size_t _snapshot_k = 0;
+}; // end class HotKeyCounter
+
+}; // end namespace swift_snails
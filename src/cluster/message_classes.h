@@ -27,6 +27,58 @@ enum MSG_CLS {
    * worker push local grad to server
    */
   WORKER_PUSH_REQUEST,
+  /*
+   * worker push local grad and PULL parameters in one request
+   * the grads are applied before the parameters are read
+   */
+  WORKER_PUSH_PULL_REQUEST,
+  /*
+   * worker PULL parameters through the aggregator of its host
+   */
+  WORKER_HOST_PULL_REQUEST,
+  /*
+   * worker push local grad through the aggregator of its host
+   */
+  WORKER_HOST_PUSH_REQUEST,
+  /*
+   * worker push the deferred grads of hot keys and the hits of its hot
+   * key cache, and fetch the current hot keys with their parameters
+   */
+  WORKER_HOT_KEYS_REQUEST,
+  /*
+   * the master tell a server to move some of its fragments to other
+   * servers
+   */
+  MASTER_MIGRATE_FRAGS,
+  /*
+   * server send the rows of the fragments it moves to their new owner
+   */
+  SERVER_RECEIVE_ROWS,
+  /*
+   * server PULL the keys of the fragments it moved away from their owner,
+   * for a worker with an old hashfrag
+   */
+  SERVER_FORWARD_PULL,
+  /*
+   * the master send the moves of fragments to every worker after a
+   * migration
+   */
+  NODE_UPDATE_HASHFRAG,
+  /*
+   * the master ask a server for the accesses of each fragment since it
+   * asked last
+   */
+  MASTER_FRAG_LOADS,
+  /*
+   * worker report its clock, the number of minibatches it finished, to
+   * the servers in the stale synchronous mode
+   */
+  WORKER_CLOCK,
+  /*
+   * worker ask the first server for the next chunk of the dataset to
+   * train on
+   */
+  WORKER_FETCH_CHUNK,
   /*
    * worker finish task and terminate
    * send message to tell the master
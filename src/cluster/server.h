@@ -5,6 +5,7 @@
 #include "../parameter/sparsetable.h"
 #include "../parameter/accessmethod.h"
 #include "message_classes.h"
+#include "hot_keys.h"
 
 namespace swift_snails {
 
@@ -35,12 +36,33 @@ public:
         _pull_access(
             std::move(make_pull_access<table_t, pull_access_t>(_sparsetable))),
         _push_access(
-            std::move(make_push_access<table_t, push_access_t>(_sparsetable))) {
+            std::move(make_push_access<table_t, push_access_t>(_sparsetable))),
+        _hot_key_num(
+            global_config().get("server", "hot_key_num", "0").to_int32()),
+        _hot_keys(16, global_config()
+                          .get("server", "hot_key_decay_ms", "1000")
+                          .to_int32()),
+        _ssp_staleness(
+            global_config().get("cluster", "ssp_staleness", "-1").to_int32()) {
+    CHECK_GE(_hot_key_num, 0);
+    // the accesses of fragments are counted for the master to move them
+    if (global_config().get("cluster", "frag_migrate_ms", "0").to_int32() > 0)
+      std::vector<std::atomic<size_t>>(
+          global_config().get("server", "frag_num").to_int32())
+          .swap(_frag_loads);
     // check init parameters
     CHECK(_pull_access && _push_access) << "access is not inited";
     init_transfer();
     init_pull_method();
     init_push_method();
+    init_push_pull_method();
+    init_hot_keys_method();
+    init_migrate_method();
+    init_receive_rows_method();
+    init_forward_pull_method();
+    init_frag_loads_method();
+    init_clock_method();
+    init_chunk_method();
   }
   /**
    * @brief load parameter from a file
@@ -64,11 +86,16 @@ public:
    * @brief called when worker finish working
    */
   void finalize(const std::string &path = "") {
+    RAW_LOG(WARNING, "server max request queue depth: %d",
+            _transfer.max_pending_requests());
+    RAW_LOG(WARNING, "server %lu keys, shard skew (max/mean): %f",
+            (unsigned long)_sparsetable.size(), _sparsetable.shard_skew());
     RAW_LOG(WARNING, "server output parameters");
-    if (path.empty())
+    if (path.empty()) {
       _sparsetable.output();
-    else
+    } else {
       _sparsetable.output(path);
+    }
 
     RAW_LOG(WARNING, "########################################");
     RAW_LOG(WARNING, "     Server [%d] terminate normally",
@@ -77,6 +104,10 @@ public:
   }
 
   Transfer<ServerWorkerRoute> &transfer() { return _transfer; }
+  /**
+   * @brief number of requests waiting to be answered
+   */
+  int queue_depth() const { return _transfer.pending_requests(); }
   /**
    * @brief to tell whether local node's Server is valid
    */
@@ -92,12 +123,358 @@ protected:
    * @brief register push method to message class
    */
   void init_push_method();
+  /**
+   * @brief register the fused push and pull method to message class
+   */
+  void init_push_pull_method();
+  /**
+   * @brief register the hot keys method to message class
+   */
+  void init_hot_keys_method();
+  /**
+   * @brief register the method to move fragments to other servers
+   */
+  void init_migrate_method();
+  /**
+   * @brief register the method to take the rows of fragments moved in
+   */
+  void init_receive_rows_method();
+  /**
+   * @brief register the method to read the keys another server forwards
+   */
+  void init_forward_pull_method();
+  /**
+   * @brief register the method to report the accesses of fragments
+   */
+  void init_frag_loads_method();
+  /**
+   * @brief register the method to take the clocks of workers
+   */
+  void init_clock_method();
+  /**
+   * @brief register the method to hand out chunks of the dataset
+   */
+  void init_chunk_method();
+  /**
+   * @brief apply the grads of a request, keys are decoded in bulk
+   *
+   * grads of the fragments in flight are held until they land, the ones
+   * of the fragments moved away go on to their owners.
+   */
+  void apply_grads(BinaryBuffer &req) {
+    std::vector<key_t> keys;
+    req.get_delta_block(keys);
+    grad_t grad;
+    rwlock_read_guard lk(_route_lock);
+    if (!_routing) {
+      count_keys(keys);
+      for (const key_t &key : keys) {
+        req >> grad;
+        _push_access->apply_push_value(key, grad);
+      }
+      return;
+    }
+    auto &hashfrag = global_hashfrag<key_t>();
+    std::vector<key_t> local_keys;
+    std::map<int, std::vector<std::pair<key_t, grad_t>>> moved;
+    for (const key_t &key : keys) {
+      req >> grad;
+      int route = _routes[hashfrag.frag_id(key)];
+      if (route == LOCAL_FRAG) {
+        _push_access->apply_push_value(key, grad);
+        local_keys.push_back(key);
+      } else if (route == MOVING_FRAG) {
+        std::lock_guard<std::mutex> hlk(_held_mut);
+        _held_grads.emplace_back(key, grad);
+      } else {
+        moved[route].emplace_back(key, grad);
+      }
+    }
+    count_keys(local_keys);
+    for (auto &item : moved)
+      forward_grads(item.first, item.second);
+  }
+  /**
+   * @brief push grads to the server that owns their keys now
+   */
+  void forward_grads(int node_id,
+                     std::vector<std::pair<key_t, grad_t>> &grads) {
+    Request req;
+    req.meta.message_class = WORKER_PUSH_REQUEST;
+    std::vector<key_t> keys;
+    keys.reserve(grads.size());
+    for (const auto &item : grads)
+      keys.push_back(item.first);
+    // keys are sorted as they were in the request
+    req.cont.put_delta_block(keys);
+    for (auto &item : grads)
+      req.cont << item.second;
+    req.call_back_handler = [](std::shared_ptr<Request>) {};
+    _transfer.send(std::move(req), node_id);
+  }
+  /**
+   * @brief answer the values of the requested keys, in their order
+   *
+   * @param lead a flag put before the values, for the requests whose
+   * response should not be empty
+   * @return false if the response is sent later by `respond()`, `rsp` is
+   * left empty then
+   */
+  bool read_values(std::shared_ptr<Request> &req, Request &rsp,
+                   bool lead = false) {
+    std::vector<key_t> keys;
+    req->cont.get_delta_block(keys);
+    return read_keys(req, keys, rsp, lead);
+  }
+  /**
+   * @brief answer the values of `keys`
+   *
+   * a read of a fragment in flight is held until the fragment lands, the
+   * keys of the fragments moved away are read from their owners and the
+   * response is sent once they all answer.
+   */
+  bool read_keys(const std::shared_ptr<Request> &req,
+                 std::vector<key_t> &keys, Request &rsp, bool lead) {
+    rwlock_read_guard lk(_route_lock);
+    if (!_routing) {
+      count_keys(keys);
+      if (lead)
+        rsp.cont << true;
+      write_values(keys, rsp.cont);
+      return true;
+    }
+    auto &hashfrag = global_hashfrag<key_t>();
+    std::vector<key_t> local_keys;
+    // the index of each key in the request, by owner
+    std::map<int, std::vector<size_t>> moved;
+    for (size_t i = 0; i < keys.size(); i++) {
+      int route = _routes[hashfrag.frag_id(keys[i])];
+      if (route == MOVING_FRAG) {
+        std::lock_guard<std::mutex> hlk(_held_mut);
+        _held_reads.push_back({req, std::move(keys), lead});
+        return false;
+      }
+      if (route == LOCAL_FRAG)
+        local_keys.push_back(keys[i]);
+      else
+        moved[route].push_back(i);
+    }
+    count_keys(local_keys);
+    if (moved.empty()) {
+      if (lead)
+        rsp.cont << true;
+      write_values(keys, rsp.cont);
+      return true;
+    }
+    auto vals = std::make_shared<std::vector<pull_t>>(keys.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+      if (_routes[hashfrag.frag_id(keys[i])] == LOCAL_FRAG)
+        _pull_access->get_pull_value(keys[i], (*vals)[i]);
+    }
+    auto num_left = std::make_shared<std::atomic<size_t>>(moved.size());
+    for (auto &item : moved) {
+      auto idxs = std::make_shared<std::vector<size_t>>(std::move(item.second));
+      std::vector<key_t> node_keys;
+      node_keys.reserve(idxs->size());
+      for (size_t i : *idxs)
+        node_keys.push_back(keys[i]);
+      Request fwd;
+      fwd.meta.message_class = SERVER_FORWARD_PULL;
+      fwd.cont.put_delta_block(node_keys);
+      fwd.call_back_handler = [this, req, lead, vals, idxs, num_left](
+          std::shared_ptr<Request> fwd_rsp) {
+        for (size_t i : *idxs)
+          fwd_rsp->cont >> (*vals)[i];
+        if (--*num_left > 0)
+          return;
+        Request rsp;
+        if (lead)
+          rsp.cont << true;
+        for (auto &val : *vals)
+          rsp.cont << val;
+        _transfer.respond(*req, std::move(rsp));
+      };
+      _transfer.send(std::move(fwd), item.first);
+    }
+    return false;
+  }
+  /**
+   * @brief count the accesses of keys served here
+   */
+  void count_keys(const std::vector<key_t> &keys) {
+    if (_hot_key_num > 0)
+      _hot_keys.add(keys);
+    if (_frag_loads.empty())
+      return;
+    auto &hashfrag = global_hashfrag<key_t>();
+    for (const key_t &key : keys)
+      _frag_loads[hashfrag.frag_id(key)]++;
+  }
+  /**
+   * @brief whether the rows of a key are here
+   * @warning `_route_lock` should be held
+   */
+  bool is_served(const key_t &key) {
+    if (!_routing)
+      return true;
+    int route = _routes[global_hashfrag<key_t>().frag_id(key)];
+    return route == LOCAL_FRAG || route == MOVING_FRAG;
+  }
+  /**
+   * @brief route the fragments moved to a server here
+   * @warning `_route_lock` should be held to write
+   */
+  void init_routes() {
+    if (_routes.empty())
+      _routes.assign(global_hashfrag<key_t>().num_frags(), LOCAL_FRAG);
+  }
+  /**
+   * @brief the rows of the moved fragments reached their new owners,
+   * route the fragments to them and go on with the requests held
+   *
+   * @param req request of the master, answered at last
+   * @param new_owners new owner of each fragment, -1 if not moved
+   */
+  void finish_migration(const std::shared_ptr<Request> &req,
+                        const std::vector<int> &new_owners) {
+    auto &hashfrag = global_hashfrag<key_t>();
+    std::vector<HeldRead> reads;
+    std::map<int, std::vector<std::pair<key_t, grad_t>>> moved;
+    {
+      rwlock_write_guard lk(_route_lock);
+      for (size_t frag_id = 0; frag_id < new_owners.size(); frag_id++) {
+        if (new_owners[frag_id] >= 0)
+          _routes[frag_id] = new_owners[frag_id];
+      }
+      std::lock_guard<std::mutex> hlk(_held_mut);
+      reads.swap(_held_reads);
+      for (auto &item : _held_grads)
+        moved[_routes[hashfrag.frag_id(item.first)]].push_back(
+            std::move(item));
+      _held_grads.clear();
+    }
+    for (auto &item : moved)
+      forward_grads(item.first, item.second);
+    // no request reads the rows moved away from here on
+    _sparsetable.erase_if([&](const key_t &key) {
+      return new_owners[hashfrag.frag_id(key)] >= 0;
+    });
+    for (auto &held : reads) {
+      Request rsp;
+      if (read_keys(held.req, held.keys, rsp, held.lead))
+        _transfer.respond(*held.req, std::move(rsp));
+    }
+    Request rsp;
+    rsp.cont << true;
+    _transfer.respond(*req, std::move(rsp));
+  }
+  /**
+   * @brief hold a pull until the slowest worker is within the staleness
+   * bound of the requester, the response is sent by `update_clock()`
+   *
+   * @return whether the pull is held
+   */
+  bool defer_read(std::shared_ptr<Request> &req) {
+    // the requests of a collective come with no client
+    if (_ssp_staleness < 0 || req->meta.client_id < 0)
+      return false;
+    std::lock_guard<std::mutex> lk(_ssp_mut);
+    if (is_fresh(req->meta.client_id))
+      return false;
+    _deferred_reads.push_back(req);
+    return true;
+  }
+  /**
+   * @brief set the clock of a worker and answer the pulls that can go on
+   */
+  void update_clock(int worker_id, int clock) {
+    std::vector<std::shared_ptr<Request>> ready;
+    {
+      std::lock_guard<std::mutex> lk(_ssp_mut);
+      int &cur = _clocks[worker_id];
+      cur = std::max(cur, clock);
+      size_t kept = 0;
+      for (size_t i = 0; i < _deferred_reads.size(); i++) {
+        if (is_fresh(_deferred_reads[i]->meta.client_id)) {
+          ready.push_back(std::move(_deferred_reads[i]));
+          continue;
+        }
+        if (kept != i)
+          _deferred_reads[kept] = std::move(_deferred_reads[i]);
+        kept++;
+      }
+      _deferred_reads.resize(kept);
+    }
+    for (auto &req : ready) {
+      Request rsp;
+      bool lead = req->meta.message_class == WORKER_PUSH_PULL_REQUEST;
+      if (read_values(req, rsp, lead))
+        _transfer.respond(*req, std::move(rsp));
+    }
+  }
+  /**
+   * whether the slowest worker is at most `ssp_staleness` clocks behind
+   * the worker
+   * @warning `_ssp_mut` should be held
+   */
+  bool is_fresh(int worker_id) {
+    int min_clock = std::numeric_limits<int>::max();
+    for (int id : global_route().worker_ids()) {
+      auto it = _clocks.find(id);
+      min_clock = std::min(min_clock, it == _clocks.end() ? 0 : it->second);
+    }
+    auto it = _clocks.find(worker_id);
+    int clock = it == _clocks.end() ? 0 : it->second;
+    return (int64_t)clock - min_clock <= _ssp_staleness;
+  }
+  void write_values(const std::vector<key_t> &keys, BinaryBuffer &rsp) {
+    pull_t val;
+    for (const key_t &key : keys) {
+      _pull_access->get_pull_value(key, val);
+      rsp << val;
+    }
+  }
 
 private:
+  // routes of the fragments, beside the node a fragment moved to
+  enum { MOVING_FRAG = -2, LOCAL_FRAG = -1 };
+  // a read of a fragment in flight
+  struct HeldRead {
+    std::shared_ptr<Request> req;
+    std::vector<key_t> keys;
+    bool lead;
+  };
+
   Transfer<ServerWorkerRoute> _transfer;
   table_t &_sparsetable;
   std::unique_ptr<PullAccessAgent<table_t, pull_access_t>> _pull_access;
   std::unique_ptr<PushAccessAgent<table_t, push_access_t>> _push_access;
+  // most accessed keys, cached by the workers
+  int _hot_key_num;
+  HotKeyCounter<key_t> _hot_keys;
+  // the route of each fragment from this server, the fragments moved
+  // away are forwarded to their owners for the workers with an old
+  // hashfrag. Empty until a fragment moves.
+  std::vector<int> _routes;
+  // whether any fragment is in flight or moved away
+  bool _routing = false;
+  RWLock _route_lock;
+  // requests of the fragments in flight
+  std::vector<HeldRead> _held_reads;
+  std::vector<std::pair<key_t, grad_t>> _held_grads;
+  std::mutex _held_mut;
+  // accesses of each fragment since the master asked last, empty if the
+  // fragments are not moved
+  std::vector<std::atomic<size_t>> _frag_loads;
+  // stale synchronous mode, -1 if disabled
+  int _ssp_staleness;
+  std::map<int, int> _clocks;
+  std::vector<std::shared_ptr<Request>> _deferred_reads;
+  std::mutex _ssp_mut;
+  // next chunk of the dataset to hand out and the number of chunks, by
+  // epoch
+  std::map<int, std::pair<int, int>> _chunks;
+  std::mutex _chunk_mut;
 };
 
 template <class ServerType> inline ServerType &global_server();
@@ -107,19 +484,18 @@ template <typename Key, typename Param, typename PullVal, typename Grad,
 void ClusterServer<Key, Param, PullVal, Grad, PullAccessMethod,
                    PushAccessMethod>::init_transfer() {
   LOG(WARNING) << "init server's transfer ...";
-  std::string listen_addr =
-      global_config().get("server", "listen_addr").to_string();
-  int service_thread_num =
-      global_config().get("server", "listen_thread_num").to_int32();
   int async_thread_num =
       global_config().get("server", "async_exec_num").to_int32();
-  if (!listen_addr.empty()) {
-    _transfer.listen(listen_addr);
-  } else {
-    _transfer.listen();
-  }
+  _transfer.set_transport(
+      make_transport("server", ServerWorkerRoute::SERVER_ROLE));
+  // pulls are not queued behind pushes
+  int pull_thread_num =
+      global_config().get("server", "pull_exec_num", "0").to_int32();
+  int push_thread_num =
+      global_config().get("server", "push_exec_num", "0").to_int32();
   _transfer.init_async_channel(async_thread_num);
-  _transfer.set_thread_num(service_thread_num);
+  _transfer.init_lane(transfer_t::PULL_LANE, pull_thread_num);
+  _transfer.init_lane(transfer_t::PUSH_LANE, push_thread_num);
   _transfer.service_start();
 }
 
@@ -130,27 +506,14 @@ void ClusterServer<Key, Param, PullVal, Grad, PullAccessMethod,
   LOG(INFO) << "server register pull message_class ...";
   transfer_t::msgcls_handler_t handler = [this](std::shared_ptr<Request> req,
                                                 Request &rsp) {
-    // read request
-    std::vector<std::pair<key_t, pull_t>> req_items;
-    while (!req->cont.read_finished()) {
-      key_t key;
-      pull_t val;
-      req->cont >> key;
-      req->cont >> val;
-      req_items.emplace_back(std::move(key), std::move(val));
-    }
-    // query parameters
-    for (auto &item : req_items) {
-      key_t &key = item.first;
-      pull_t &val = item.second;
-      _pull_access->get_pull_value(key, val);
-      // put response
-      rsp.cont << key;
-      rsp.cont << val;
-    }
+    // an empty response is not sent, it goes after the clocks catch up
+    if (defer_read(req))
+      return;
+    read_values(req, rsp);
   };
 
   _transfer.message_class().add(WORKER_PULL_REQUEST, std::move(handler));
+  _transfer.set_lane(WORKER_PULL_REQUEST, transfer_t::PULL_LANE);
 }
 
 template <typename Key, typename Param, typename PullVal, typename Grad,
@@ -160,19 +523,248 @@ void ClusterServer<Key, Param, PullVal, Grad, PullAccessMethod,
   LOG(INFO) << "server register push message_class ...";
   transfer_t::msgcls_handler_t handler = [this](std::shared_ptr<Request> req,
                                                 Request &rsp) {
-    // std::vector<push_val_t> req_items;
+    apply_grads(req->cont);
+    rsp.cont << 1234;
+  };
+
+  _transfer.message_class().add(WORKER_PUSH_REQUEST, std::move(handler));
+  _transfer.set_lane(WORKER_PUSH_REQUEST, transfer_t::PUSH_LANE);
+}
+
+template <typename Key, typename Param, typename PullVal, typename Grad,
+          typename PullAccessMethod, typename PushAccessMethod>
+void ClusterServer<Key, Param, PullVal, Grad, PullAccessMethod,
+                   PushAccessMethod>::init_push_pull_method() {
+  LOG(INFO) << "server register push-pull message_class ...";
+  transfer_t::msgcls_handler_t handler = [this](std::shared_ptr<Request> req,
+                                                Request &rsp) {
+    // the pulled values contain the grads just pushed
+    apply_grads(req->cont);
+    if (defer_read(req))
+      return;
+    // a leading flag keeps the response from being empty when no key
+    // is pulled, empty responses are not sent
+    read_values(req, rsp, true);
+  };
+
+  _transfer.message_class().add(WORKER_PUSH_PULL_REQUEST, std::move(handler));
+  // the worker is waiting for the values
+  _transfer.set_lane(WORKER_PUSH_PULL_REQUEST, transfer_t::PULL_LANE);
+}
+
+template <typename Key, typename Param, typename PullVal, typename Grad,
+          typename PullAccessMethod, typename PushAccessMethod>
+void ClusterServer<Key, Param, PullVal, Grad, PullAccessMethod,
+                   PushAccessMethod>::init_hot_keys_method() {
+  LOG(INFO) << "server register hot keys message_class ...";
+  transfer_t::msgcls_handler_t handler = [this](std::shared_ptr<Request> req,
+                                                Request &rsp) {
+    apply_grads(req->cont);
+    // keys served from the cache of the worker are still accessed
+    std::vector<key_t> hit_keys;
+    req->cont.get_delta_block(hit_keys);
+    std::vector<size_t> hits(hit_keys.size());
+    for (size_t &hit : hits)
+      hit = req->cont.get_varint();
+    rsp.cont << true;
+    std::vector<key_t> keys;
+    if (_hot_key_num > 0) {
+      _hot_keys.add(hit_keys, hits);
+      keys = _hot_keys.top(_hot_key_num);
+    }
+    // the keys moved away are cached from their owners
+    rwlock_read_guard lk(_route_lock);
+    keys.erase(std::remove_if(keys.begin(), keys.end(),
+                              [this](const key_t &key) {
+                                return !is_served(key);
+                              }),
+               keys.end());
+    rsp.cont.put_delta_block(keys);
+    write_values(keys, rsp.cont);
+  };
+
+  _transfer.message_class().add(WORKER_HOT_KEYS_REQUEST, std::move(handler));
+  _transfer.set_lane(WORKER_HOT_KEYS_REQUEST, transfer_t::PULL_LANE);
+}
+
+template <typename Key, typename Param, typename PullVal, typename Grad,
+          typename PullAccessMethod, typename PushAccessMethod>
+void ClusterServer<Key, Param, PullVal, Grad, PullAccessMethod,
+                   PushAccessMethod>::init_migrate_method() {
+  LOG(INFO) << "server register migrate message_class ...";
+  transfer_t::msgcls_handler_t handler = [this](std::shared_ptr<Request> req,
+                                                Request &) {
+    auto &hashfrag = global_hashfrag<key_t>();
+    // new owner of each fragment, -1 if not moved
+    std::vector<int> new_owners(hashfrag.num_frags(), -1);
+    // fragments moved to each node
+    std::map<int, std::vector<int>> node_frags;
+    int num_moves;
+    req->cont >> num_moves;
+    for (int i = 0; i < num_moves; i++) {
+      int frag_id, node_id;
+      req->cont >> frag_id;
+      req->cont >> node_id;
+      new_owners[frag_id] = node_id;
+      node_frags[node_id].push_back(frag_id);
+    }
+    CHECK(!node_frags.empty());
+    {
+      // the requests reading or writing the fragments are held from here
+      rwlock_write_guard lk(_route_lock);
+      init_routes();
+      for (const auto &item : node_frags) {
+        for (int frag_id : item.second) {
+          CHECK_EQ(_routes[frag_id], LOCAL_FRAG)
+              << "fragment " << frag_id << " is not served here";
+          _routes[frag_id] = MOVING_FRAG;
+        }
+      }
+      _routing = true;
+    }
+    std::map<int, Request> rows;
+    for (const auto &item : node_frags) {
+      BinaryBuffer &bb = rows[item.first].cont;
+      bb << (int)item.second.size();
+      for (int frag_id : item.second)
+        bb << frag_id;
+    }
+    _sparsetable.for_each([&](const key_t &key, param_t &param) {
+      int node_id = new_owners[hashfrag.frag_id(key)];
+      if (node_id < 0)
+        return;
+      BinaryBuffer &bb = rows[node_id].cont;
+      bb << key;
+      bb << param;
+    });
+    RAW_LOG(WARNING, "server moves %d fragments to %lu servers", num_moves,
+            (unsigned long)rows.size());
+    // the master is answered once every new owner has the rows
+    auto num_left = std::make_shared<std::atomic<size_t>>(rows.size());
+    for (auto &item : rows) {
+      Request &row_req = item.second;
+      row_req.meta.message_class = SERVER_RECEIVE_ROWS;
+      row_req.call_back_handler = [this, req, new_owners, num_left](
+          std::shared_ptr<Request>) {
+        if (--*num_left == 0)
+          finish_migration(req, new_owners);
+      };
+      _transfer.send(std::move(row_req), item.first);
+    }
+  };
+
+  _transfer.message_class().add(MASTER_MIGRATE_FRAGS, std::move(handler));
+}
+
+template <typename Key, typename Param, typename PullVal, typename Grad,
+          typename PullAccessMethod, typename PushAccessMethod>
+void ClusterServer<Key, Param, PullVal, Grad, PullAccessMethod,
+                   PushAccessMethod>::init_receive_rows_method() {
+  LOG(INFO) << "server register receive rows message_class ...";
+  transfer_t::msgcls_handler_t handler = [this](std::shared_ptr<Request> req,
+                                                Request &rsp) {
+    int num_frags;
+    req->cont >> num_frags;
+    std::vector<int> frag_ids(num_frags);
+    for (int &frag_id : frag_ids)
+      req->cont >> frag_id;
+    key_t key;
+    param_t param;
     while (!req->cont.read_finished()) {
-      key_t key;
-      grad_t grad;
       req->cont >> key;
-      req->cont >> grad;
-      // RAW_LOG_INFO ("bb >> key:\t%d", key);
-      _push_access->apply_push_value(key, grad);
+      req->cont >> param;
+      _sparsetable.assign(key, param);
     }
-    rsp.cont << 1234;
+    // a fragment moved back is served here again
+    rwlock_write_guard lk(_route_lock);
+    init_routes();
+    for (int frag_id : frag_ids)
+      _routes[frag_id] = LOCAL_FRAG;
+    rsp.cont << true;
   };
 
-  _transfer.message_class().add(WORKER_PUSH_REQUEST, std::move(handler));
+  _transfer.message_class().add(SERVER_RECEIVE_ROWS, std::move(handler));
+}
+
+template <typename Key, typename Param, typename PullVal, typename Grad,
+          typename PullAccessMethod, typename PushAccessMethod>
+void ClusterServer<Key, Param, PullVal, Grad, PullAccessMethod,
+                   PushAccessMethod>::init_forward_pull_method() {
+  LOG(INFO) << "server register forward pull message_class ...";
+  transfer_t::msgcls_handler_t handler = [this](std::shared_ptr<Request> req,
+                                                Request &rsp) {
+    // the requester is a server, not held by the clocks
+    read_values(req, rsp);
+  };
+
+  _transfer.message_class().add(SERVER_FORWARD_PULL, std::move(handler));
+  _transfer.set_lane(SERVER_FORWARD_PULL, transfer_t::PULL_LANE);
+}
+
+template <typename Key, typename Param, typename PullVal, typename Grad,
+          typename PullAccessMethod, typename PushAccessMethod>
+void ClusterServer<Key, Param, PullVal, Grad, PullAccessMethod,
+                   PushAccessMethod>::init_frag_loads_method() {
+  LOG(INFO) << "server register fragment loads message_class ...";
+  transfer_t::msgcls_handler_t handler = [this](std::shared_ptr<Request>,
+                                                Request &rsp) {
+    std::vector<std::pair<int, size_t>> loads;
+    for (size_t frag_id = 0; frag_id < _frag_loads.size(); frag_id++) {
+      size_t load = _frag_loads[frag_id].exchange(0);
+      if (load > 0)
+        loads.emplace_back(frag_id, load);
+    }
+    rsp.cont << (int)loads.size();
+    for (const auto &item : loads) {
+      rsp.cont << item.first;
+      rsp.cont << item.second;
+    }
+  };
+
+  _transfer.message_class().add(MASTER_FRAG_LOADS, std::move(handler));
+}
+
+template <typename Key, typename Param, typename PullVal, typename Grad,
+          typename PullAccessMethod, typename PushAccessMethod>
+void ClusterServer<Key, Param, PullVal, Grad, PullAccessMethod,
+                   PushAccessMethod>::init_clock_method() {
+  LOG(INFO) << "server register clock message_class ...";
+  transfer_t::msgcls_handler_t handler = [this](std::shared_ptr<Request> req,
+                                                Request &rsp) {
+    int clock;
+    req->cont >> clock;
+    update_clock(req->meta.client_id, clock);
+    rsp.cont << true;
+  };
+
+  _transfer.message_class().add(WORKER_CLOCK, std::move(handler));
+}
+
+template <typename Key, typename Param, typename PullVal, typename Grad,
+          typename PullAccessMethod, typename PushAccessMethod>
+void ClusterServer<Key, Param, PullVal, Grad, PullAccessMethod,
+                   PushAccessMethod>::init_chunk_method() {
+  LOG(INFO) << "server register chunk message_class ...";
+  transfer_t::msgcls_handler_t handler = [this](std::shared_ptr<Request> req,
+                                                Request &rsp) {
+    int epoch, num_chunks;
+    req->cont >> epoch;
+    req->cont >> num_chunks;
+    int chunk = -1;
+    {
+      std::lock_guard<std::mutex> lk(_chunk_mut);
+      auto it = _chunks.find(epoch);
+      if (it == _chunks.end())
+        it = _chunks.emplace(epoch, std::make_pair(0, num_chunks)).first;
+      CHECK_EQ(it->second.second, num_chunks)
+          << "workers should train on the same dataset";
+      if (it->second.first < num_chunks)
+        chunk = it->second.first++;
+    }
+    rsp.cont << chunk;
+  };
+
+  _transfer.message_class().add(WORKER_FETCH_CHUNK, std::move(handler));
 }
 
 template <typename ServerT> inline ServerT &global_server() {
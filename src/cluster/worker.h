@@ -10,6 +10,8 @@ namespace swift_snails {
  */
 class ClusterWorker {
 public:
+  typedef Transfer<ServerWorkerRoute> transfer_t;
+
   ClusterWorker() { init_transfer(); }
 
   Transfer<ServerWorkerRoute> &transfer() { return _transfer; }
@@ -26,28 +28,37 @@ public:
    * @brief to tell whether local node's Worker is valid
    */
   bool is_valid() const { return _transfer.client_id() >= 0; }
+  /**
+   * @brief worker id of the host aggregator that pulls and pushes go
+   * through, -1 to talk to the servers directly
+   */
+  int host_leader() const { return _host_leader; }
+  void set_host_leader(int id) { _host_leader = id; }
 
 protected:
   void init_transfer() {
     LOG(WARNING) << "init worker's transfer ...";
-    std::string listen_addr =
-        global_config().get("worker", "listen_addr").to_string();
-    int service_thread_num =
-        global_config().get("worker", "listen_thread_num").to_int32();
     int async_thread_num =
         global_config().get("worker", "async_exec_num").to_int32();
-    if (!listen_addr.empty()) {
-      _transfer.listen(listen_addr);
-    } else {
-      _transfer.listen();
-    }
+    _transfer.set_transport(
+        make_transport("worker", ServerWorkerRoute::WORKER_ROLE));
+    int max_inflight_messages =
+        global_config().get("worker", "max_inflight_messages", "0").to_int32();
+    int max_inflight_bytes =
+        global_config().get("worker", "max_inflight_bytes", "0").to_int32();
+    CHECK_GE(max_inflight_bytes, 0);
+    _transfer.set_flow_control(max_inflight_messages, max_inflight_bytes);
+    // response callbacks do not queue behind other tasks
+    int response_thread_num =
+        global_config().get("worker", "response_exec_num", "0").to_int32();
     _transfer.init_async_channel(async_thread_num);
-    _transfer.set_thread_num(service_thread_num);
+    _transfer.init_lane(transfer_t::RESPONSE_LANE, response_thread_num);
     _transfer.service_start();
   }
 
 private:
   Transfer<ServerWorkerRoute> _transfer;
+  int _host_leader = -1;
 }; // end class Worker
 
 inline ClusterWorker &global_worker() {
@@ -0,0 +1,81 @@
+#pragma once
+#include "../utils/all.h"
+#include "../transfer/transfer.h"
+namespace swift_snails {
+/**
+ * @brief exchange a buffer with every rank in one collective
+ *
+ * byte counts are exchanged with MPI_Alltoall, then the bytes with
+ * MPI_Alltoallv
+ *
+ * @param send buffers to each rank, indexed by rank
+ * @param recv buffers from each rank, indexed by rank
+ * @warning every rank should call it at the same time
+ */
+inline void alltoallv_exchange(std::vector<BinaryBuffer> &send,
+                               std::vector<BinaryBuffer> &recv) {
+  const int size = global_mpi().size();
+  CHECK_EQ((int)send.size(), size);
+  CHECK_EQ((int)recv.size(), size);
+  std::vector<int> send_counts(size), send_displs(size);
+  std::vector<int> recv_counts(size), recv_displs(size);
+  size_t total = 0;
+  for (int rank = 0; rank < size; rank++) {
+    send_counts[rank] = send[rank].size();
+    send_displs[rank] = total;
+    total += send[rank].size();
+    CHECK_LE(total, (size_t)std::numeric_limits<int>::max());
+  }
+  std::vector<char> send_bytes(std::max<size_t>(total, 1));
+  for (int rank = 0; rank < size; rank++) {
+    if (send_counts[rank] > 0)
+      memcpy(&send_bytes[send_displs[rank]], send[rank].buffer(),
+             send_counts[rank]);
+  }
+  CHECK(0 == MPI_Alltoall(&send_counts[0], 1, MPI_INT, &recv_counts[0], 1,
+                          MPI_INT, MPI_COMM_WORLD));
+  total = 0;
+  for (int rank = 0; rank < size; rank++) {
+    recv_displs[rank] = total;
+    total += recv_counts[rank];
+    CHECK_LE(total, (size_t)std::numeric_limits<int>::max());
+  }
+  std::vector<char> recv_bytes(std::max<size_t>(total, 1));
+  CHECK(0 == MPI_Alltoallv(&send_bytes[0], &send_counts[0], &send_displs[0],
+                           MPI_BYTE, &recv_bytes[0], &recv_counts[0],
+                           &recv_displs[0], MPI_BYTE, MPI_COMM_WORLD));
+  for (int rank = 0; rank < size; rank++) {
+    recv[rank].clear();
+    if (recv_counts[rank] > 0)
+      recv[rank].set(&recv_bytes[recv_displs[rank]], recv_counts[rank]);
+  }
+}
+/**
+ * @brief answer the requests from every rank with the handler of the
+ * server living in the local process
+ *
+ * @param worker_transfer transfer of the local worker
+ * @param message_class message class of the requests
+ * @param reqs requests from each rank, empty if the rank sends none
+ * @param rsps responses to each rank
+ */
+inline void serve_local(Transfer<ServerWorkerRoute> &worker_transfer,
+                        int message_class, std::vector<BinaryBuffer> &reqs,
+                        std::vector<BinaryBuffer> &rsps) {
+  auto *server = worker_transfer.local_peer();
+  CHECK(server) << "collective exchange needs a server on every rank";
+  CHECK_EQ(reqs.size(), rsps.size());
+  for (size_t rank = 0; rank < reqs.size(); rank++) {
+    rsps[rank].clear();
+    if (reqs[rank].size() == 0)
+      continue;
+    auto req = std::make_shared<Request>();
+    req->meta.message_class = message_class;
+    req->cont = std::move(reqs[rank]);
+    Request rsp;
+    server->handle_local(req, rsp);
+    rsps[rank] = std::move(rsp.cont);
+  }
+}
+
+}; // end namespace swift_snails
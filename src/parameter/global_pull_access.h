@@ -4,6 +4,8 @@
 #include "../cluster/message_classes.h"
 #include "../cluster/hashfrag.h"
 #include "param.h"
+#include "bsp_exchange.h"
+#include "hot_key_cache.h"
 namespace swift_snails {
 /**
  * @brief pull parameter from remote Server
@@ -19,82 +21,156 @@ public:
   typedef Key key_t;
   typedef Val val_t;
   typedef Grad grad_t;
-  // pull key-value
-  typedef std::pair<key_t, val_t> pull_val_t;
   typedef LocalParamCache<key_t, val_t, grad_t> param_cache_t;
 
   GlobalPullAccess() : gtransfer(global_worker().transfer()) {}
 
-  void pull_with_barrier(const std::unordered_set<key_t> &keys,
-                         param_cache_t &param_cache) {
+  /**
+   * @param param_cache `LocalParamCache` or `SlotParamCache`
+   */
+  template <class Cache>
+  void pull_with_barrier(const std::unordered_set<key_t> &all_keys,
+                         Cache &param_cache) {
     StateBarrier barrier;
-    std::atomic<size_t> num_reqs{0};
-    std::map<int, std::vector<pull_val_t>> node_reqs;
-    num_reqs = arrange_local_vals(keys, node_reqs);
+    pull_async(all_keys, param_cache, [&barrier] {
+      barrier.set_state_valid();
+      barrier.try_unblock();
+    });
+    barrier.block();
+  }
+  /**
+   * @brief pull without waiting, `done` is called once the values of
+   * `all_keys` are in the cache
+   *
+   * `done` is run by a response thread, or by the calling thread if no
+   * request is sent, so it should not block.
+   *
+   * @param param_cache should live until `done` is called
+   */
+  template <class Cache>
+  void pull_async(const std::unordered_set<key_t> &all_keys,
+                  Cache &param_cache, voidf_t done) {
+    // hot keys are served by the local replica
+    auto &hot_keys = global_hot_key_cache<key_t, val_t, grad_t>();
+    std::unordered_set<key_t> misses;
+    if (hot_keys.enabled())
+      hot_keys.serve(all_keys, param_cache, misses);
+    const auto &keys = hot_keys.enabled() ? misses : all_keys;
+    std::map<int, std::vector<key_t>> node_reqs;
+    size_t num_reqs = 0;
+    int message_class = WORKER_PULL_REQUEST;
+    const int host_leader = global_worker().host_leader();
+    if (host_leader >= 0) {
+      // the aggregator of the host pulls from the servers
+      message_class = WORKER_HOST_PULL_REQUEST;
+      std::vector<key_t> &leader_keys = node_reqs[host_leader];
+      leader_keys.assign(keys.begin(), keys.end());
+      std::sort(leader_keys.begin(), leader_keys.end());
+      num_reqs = leader_keys.empty() ? 0 : 1;
+    } else {
+      num_reqs = arrange_local_vals(keys, node_reqs);
+    }
+    if (num_reqs == 0) {
+      done();
+      return;
+    }
 
-    voidf_t extra_rsp_callback = [&barrier, &num_reqs] {
-      if (--num_reqs == 0) {
-        barrier.set_state_valid();
-        barrier.try_unblock();
-      }
+    auto rest = std::make_shared<std::atomic<size_t>>(num_reqs);
+    voidf_t extra_rsp_callback = [rest, done] {
+      if (--*rest == 0)
+        done();
     };
-    send(node_reqs, param_cache, extra_rsp_callback);
-    barrier.block();
+    send(node_reqs, param_cache, extra_rsp_callback, message_class);
   }
 
-protected:
-  size_t arrange_local_vals(const std::unordered_set<key_t> &keys,
-                            std::map<int, std::vector<pull_val_t>> &node_reqs) {
-    pull_val_t param; // empty value
+  /**
+   * @brief pull in a bulk-synchronous collective
+   *
+   * the keys to every server are exchanged with MPI_Alltoallv, each rank's
+   * server answers the requests it gets, and the values come back by a
+   * second exchange.
+   *
+   * @warning every rank should call it at the same time, and every rank
+   * should run both a worker and a server
+   */
+  template <class Cache>
+  void pull_bsp(const std::unordered_set<key_t> &keys, Cache &param_cache) {
+    const int size = global_mpi().size();
+    std::map<int, std::vector<key_t>> node_reqs;
+    arrange_local_vals(keys, node_reqs);
+    // one server per rank
+    std::vector<std::vector<key_t>> rank_keys(size);
+    std::vector<BinaryBuffer> reqs(size), rsps(size);
+    for (auto &item : node_reqs) {
+      int rank = global_route().node_rank(item.first);
+      rank_keys[rank] = std::move(item.second);
+      reqs[rank].put_delta_block(rank_keys[rank]);
+    }
+    std::vector<BinaryBuffer> server_reqs(size), server_rsps(size);
+    alltoallv_exchange(reqs, server_reqs);
+    serve_local(gtransfer, WORKER_PULL_REQUEST, server_reqs, server_rsps);
+    alltoallv_exchange(server_rsps, rsps);
 
+    for (int rank = 0; rank < size; rank++) {
+      read_values(rsps[rank], rank_keys[rank], param_cache);
+      CHECK(rsps[rank].read_finished());
+    }
+  }
+  /*
+   * split keys by node, keys to each node are sorted to be
+   * delta-encoded on the wire
+   */
+  static size_t
+  arrange_local_vals(const std::unordered_set<key_t> &keys,
+                     std::map<int, std::vector<key_t>> &node_reqs) {
     for (const auto &key : keys) {
       int node_id = global_hashfrag<key_t>().to_node_id(key);
-      if (node_reqs.count(node_id) == 0) {
-        node_reqs[node_id] = std::move(std::vector<pull_val_t>());
-      }
-
-      param.first = key;
-      node_reqs[node_id].push_back(param);
+      node_reqs[node_id].push_back(key);
+    }
+    for (auto &item : node_reqs) {
+      std::sort(item.second.begin(), item.second.end());
     }
     return node_reqs.size();
   }
+  /**
+   * @brief write the values of a response to the cache
+   * values are in the order of the keys sent
+   */
+  template <class Cache>
+  static void read_values(BinaryBuffer &bb, const std::vector<key_t> &keys,
+                          Cache &param_cache) {
+    val_t val;
+    rwlock_write_guard lk(param_cache.rwlock());
+    for (const key_t &key : keys) {
+      bb >> val;
+      param_cache.set_param(key, std::move(val));
+    }
+  }
+
+protected:
   /*
    * @extra_rsp_callback will be called after
    * send()'s response_recall_back finished
    */
-  void send(std::map<int, std::vector<pull_val_t>> &items,
-            param_cache_t &param_cache,
-            voidf_t extra_rsp_callback = voidf_t()) {
+  template <class Cache>
+  void send(std::map<int, std::vector<key_t>> &items, Cache &param_cache,
+            voidf_t extra_rsp_callback = voidf_t(),
+            int message_class = WORKER_PULL_REQUEST) {
     for (auto &item : items) {
       int node_id = item.first;
-      auto &values = item.second;
+      // the response carries values only, in the order of the keys
+      auto keys = std::make_shared<std::vector<key_t>>(std::move(item.second));
       // LOG(INFO) << "to send to " << node_id;
       Request req;
-      req.meta.message_class = WORKER_PULL_REQUEST;
-      for (auto &value : values) {
-        req.cont << value.first;
-        req.cont << value.second;
-      }
+      req.meta.message_class = message_class;
+      req.cont.put_delta_block(*keys);
       // get remote parameters
       // rewrite to local cache
-      req.call_back_handler = [this, &param_cache, extra_rsp_callback](
+      req.call_back_handler = [this, &param_cache, keys, extra_rsp_callback](
           std::shared_ptr<Request> rsp) {
-        key_t key;
-        val_t val;
         // write local cache
-        auto &params = param_cache.params();
-        auto &grads = param_cache.grads();
-        // TODO put rwlock inside?
-        {
-          rwlock_write_guard lk(param_cache.rwlock());
-          while (!rsp->cont.read_finished()) {
-            rsp->cont >> key;
-            rsp->cont >> val;
-            params[key] = std::move(val);
-            // reset grads
-            grads[key] = grad_t();
-          }
-        }
+        read_values(rsp->cont, *keys, param_cache);
+        CHECK(rsp->cont.read_finished());
 
         if (extra_rsp_callback)
           extra_rsp_callback();
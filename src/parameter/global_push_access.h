@@ -4,6 +4,8 @@
 #include "../transfer/transfer.h"
 #include "../cluster/hashfrag.h"
 #include "param.h"
+#include "bsp_exchange.h"
+#include "global_pull_access.h"
 namespace swift_snails {
 /**
  * @brief push local grads to remote parameter servers
@@ -20,69 +22,300 @@ public:
   typedef Grad grad_t;
   typedef std::pair<key_t, grad_t> push_val_t;
   typedef LocalParamCache<key_t, val_t, grad_t> param_cache_t;
+  typedef GlobalPullAccess<key_t, val_t, grad_t> pull_access_t;
 
-  GlobalPushAccess() : gtransfer(global_worker().transfer()) {}
+  GlobalPushAccess()
+      : gtransfer(global_worker().transfer()),
+        _grad_threshold(global_config()
+                            .get("worker", "push_grad_threshold", "0")
+                            .to_float()),
+        _topk_ratio(
+            global_config().get("worker", "push_topk_ratio", "1").to_float()) {
+    CHECK_GE(_grad_threshold, 0);
+    CHECK(_topk_ratio > 0 && _topk_ratio <= 1)
+        << "push_topk_ratio should be in (0, 1]";
+  }
 
+  /**
+   * @param param_cache `LocalParamCache` or `SlotParamCache`
+   * @param flush push every residual of `keys` whatever its magnitude
+   */
+  template <class Cache>
   void push_with_barrier(const std::unordered_set<key_t> &keys,
-                         param_cache_t &param_cache) {
+                         Cache &param_cache, bool flush = false) {
     StateBarrier barrier;
-    std::atomic<size_t> num_reqs{0};
-
+    push_async(keys, param_cache,
+               [&barrier] {
+                 barrier.set_state_valid();
+                 barrier.try_unblock();
+               },
+               flush);
+    barrier.block();
+  }
+  /**
+   * @brief push without waiting, `done` is called once every server
+   * answered
+   *
+   * the grads are taken out of `param_cache` before it returns. `done` is
+   * run by a response thread, or by the calling thread if no request is
+   * sent, so it should not block.
+   */
+  template <class Cache>
+  void push_async(const std::unordered_set<key_t> &keys, Cache &param_cache,
+                  voidf_t done, bool flush = false) {
     std::map<int, std::vector<push_val_t>> node_reqs;
-    num_reqs = arrange_local_grads(keys, param_cache, node_reqs);
+    size_t num_reqs = arrange_local_grads(keys, param_cache, node_reqs, flush);
+    // grads of hot keys are pushed with the next refresh of the replica
+    auto &hot_keys = global_hot_key_cache<key_t, val_t, grad_t>();
+    if (hot_keys.enabled()) {
+      hot_keys.defer(node_reqs);
+      num_reqs = node_reqs.size();
+    }
+    int message_class = WORKER_PUSH_REQUEST;
+    const int host_leader = global_worker().host_leader();
+    if (host_leader >= 0 && num_reqs > 0) {
+      // the aggregator of the host merges the grads for the servers
+      message_class = WORKER_HOST_PUSH_REQUEST;
+      std::vector<push_val_t> grads;
+      for (auto &item : node_reqs)
+        for (auto &grad : item.second)
+          grads.push_back(std::move(grad));
+      node_reqs.clear();
+      node_reqs[host_leader] = std::move(grads);
+      num_reqs = 1;
+    }
+    if (num_reqs == 0) {
+      done();
+      return;
+    }
 
-    voidf_t extra_rsp_callback = [&barrier, &num_reqs] {
-      if (--num_reqs == 0) {
-        barrier.set_state_valid();
-        barrier.try_unblock();
-      }
+    auto rest = std::make_shared<std::atomic<size_t>>(num_reqs);
+    voidf_t extra_rsp_callback = [rest, done] {
+      if (--*rest == 0)
+        done();
     };
+    send(node_reqs, extra_rsp_callback, message_class);
+  }
+  /**
+   * @brief push the grads of `push_keys` and pull the values of `pull_keys`
+   * in one round trip
+   *
+   * every server gets a single request, it applies the grads before
+   * reading the values, so keys in both sets get the updated values.
+   *
+   * @param pull_cache can be `push_cache`, the grads are taken out before
+   * the requests are sent
+   */
+  template <class PushCache, class PullCache>
+  void push_pull_with_barrier(const std::unordered_set<key_t> &push_keys,
+                              PushCache &push_cache,
+                              const std::unordered_set<key_t> &pull_keys,
+                              PullCache &pull_cache) {
+    std::map<int, std::vector<push_val_t>> push_reqs;
+    std::map<int, std::vector<key_t>> pull_reqs;
+    arrange_local_grads(push_keys, push_cache, push_reqs);
+    pull_access_t::arrange_local_vals(pull_keys, pull_reqs);
+    std::set<int> node_ids;
+    for (const auto &item : push_reqs)
+      node_ids.insert(item.first);
+    for (const auto &item : pull_reqs)
+      node_ids.insert(item.first);
+    if (node_ids.empty())
+      return;
 
-    send(node_reqs, extra_rsp_callback);
+    StateBarrier barrier;
+    std::atomic<size_t> num_reqs{node_ids.size()};
+    for (int node_id : node_ids) {
+      auto keys = std::make_shared<std::vector<key_t>>(
+          std::move(pull_reqs[node_id]));
+      Request req;
+      req.meta.message_class = WORKER_PUSH_PULL_REQUEST;
+      encode_grads(push_reqs[node_id], req.cont);
+      req.cont.put_delta_block(*keys);
+      req.call_back_handler = [keys, &pull_cache, &barrier, &num_reqs](
+          std::shared_ptr<Request> rsp) {
+        CHECK(rsp->cont.get<bool>());
+        pull_access_t::read_values(rsp->cont, *keys, pull_cache);
+        CHECK(rsp->cont.read_finished());
+        if (--num_reqs == 0) {
+          barrier.set_state_valid();
+          barrier.try_unblock();
+        }
+      };
+      gtransfer.send(std::move(req), node_id);
+    }
     barrier.block();
   }
+  /**
+   * @brief push in a bulk-synchronous collective
+   *
+   * grads to every server are exchanged with MPI_Alltoallv and each rank's
+   * server applies the ones it gets before returning.
+   *
+   * @warning every rank should call it at the same time, and every rank
+   * should run both a worker and a server
+   */
+  template <class Cache>
+  void push_bsp(const std::unordered_set<key_t> &keys, Cache &param_cache,
+                bool flush = false) {
+    const int size = global_mpi().size();
+    std::map<int, std::vector<push_val_t>> node_reqs;
+    arrange_local_grads(keys, param_cache, node_reqs, flush);
+    std::vector<BinaryBuffer> reqs(size);
+    for (auto &item : node_reqs) {
+      encode_grads(item.second, reqs[global_route().node_rank(item.first)]);
+    }
+    std::vector<BinaryBuffer> server_reqs(size), server_rsps(size);
+    alltoallv_exchange(reqs, server_reqs);
+    // the acknowledgements are not needed
+    serve_local(gtransfer, WORKER_PUSH_REQUEST, server_reqs, server_rsps);
+  }
+  /**
+   * @brief whether grads that are not pushed stay in the local cache
+   *
+   * when true, the caller should not drop the grads of the cache between
+   * minibatches, the residuals will be added to the next push.
+   */
+  bool keeps_residual() const {
+    return _grad_threshold > 0 || _topk_ratio < 1;
+  }
+  /**
+   * @brief push every residual held in `param_cache`
+   *
+   * should be called at the end of an iteration, the residual of a key
+   * that does not show up in a later push would be lost otherwise.
+   *
+   * @param bsp push in a collective, every rank should call it
+   */
+  void flush_residuals(param_cache_t &param_cache, bool bsp = false) {
+    if (!keeps_residual())
+      return;
+    std::unordered_set<key_t> keys;
+    param_cache.grad_keys(keys);
+    if (bsp)
+      push_bsp(keys, param_cache, true);
+    else
+      push_with_barrier(keys, param_cache, true);
+  }
+  /**
+   * @brief ratio of candidate rows that were held back as residuals
+   * since the last call of `reset_sparsity()`
+   */
+  float sparsity() const {
+    size_t num_candidates = _num_candidates;
+    if (num_candidates == 0)
+      return 0;
+    return 1 - float(_num_pushed) / num_candidates;
+  }
+  void reset_sparsity() {
+    _num_candidates = 0;
+    _num_pushed = 0;
+  }
 
 protected:
   void reset_local_grad(grad_t &grad) { grad.reset(); }
 
+  template <class Cache>
   size_t
   arrange_local_grads(const std::unordered_set<key_t> &keys,
-                      param_cache_t &param_cache,
-                      std::map<int, std::vector<push_val_t>> &node_reqs) {
-    auto &grads = param_cache.grads();
-    // split grads to different nodes
+                      Cache &param_cache,
+                      std::map<int, std::vector<push_val_t>> &node_reqs,
+                      bool flush = false) {
+    // candidate rows and their magnitudes
+    std::vector<std::pair<float, grad_t *>> candidates;
+    std::vector<key_t> candidate_keys;
+    candidates.reserve(keys.size());
+    candidate_keys.reserve(keys.size());
     for (auto key : keys) {
+      grad_t *grad = param_cache.find_grad(key);
+      if (grad == nullptr)
+        continue;
+      float magnitude = keeps_residual() ? grad->magnitude() : 0;
+      candidates.emplace_back(magnitude, grad);
+      candidate_keys.push_back(key);
+    }
+    // a flush pushes every nonzero row
+    float cutoff = flush ? std::numeric_limits<float>::min()
+                         : push_cutoff(candidates);
+    size_t num_pushed = 0;
+    // split grads to different nodes
+    for (size_t i = 0; i < candidates.size(); i++) {
+      const key_t &key = candidate_keys[i];
+      // keep the residual in local cache, it will be pushed with
+      // the following grads
+      if (keeps_residual() && candidates[i].first < cutoff)
+        continue;
       int node_id = global_hashfrag<key_t>().to_node_id(key);
-      if (node_reqs.count(node_id) == 0) {
-        node_reqs[node_id] = std::move(std::vector<push_val_t>());
-      }
-      auto it = grads.find(key);
-      // CHECK(it != grads.end());
-      if (it != grads.end()) {
-        node_reqs[node_id].push_back(*it);
-        reset_local_grad(it->second);
-      }
+      grad_t &grad = *candidates[i].second;
+      node_reqs[node_id].emplace_back(key, grad);
+      reset_local_grad(grad);
+      num_pushed++;
     }
+    _num_candidates += candidates.size();
+    _num_pushed += num_pushed;
     return node_reqs.size();
   }
+  /**
+   * @brief minimum magnitude of a grad row to be pushed
+   *
+   * a row is pushed if its magnitude reaches `push_grad_threshold` or
+   * it is in the top `push_topk_ratio` of the candidates.
+   */
+  float push_cutoff(std::vector<std::pair<float, grad_t *>> &candidates) {
+    if (!keeps_residual() || candidates.empty())
+      return 0;
+    // rows with zero magnitude are never worth pushing
+    float cutoff = std::numeric_limits<float>::min();
+    if (_topk_ratio < 1) {
+      size_t k = std::max<size_t>(1, candidates.size() * _topk_ratio);
+      std::vector<float> magnitudes;
+      magnitudes.reserve(candidates.size());
+      for (const auto &item : candidates)
+        magnitudes.push_back(item.first);
+      std::nth_element(magnitudes.begin(), magnitudes.begin() + (k - 1),
+                       magnitudes.end(), std::greater<float>());
+      cutoff = std::max(cutoff, magnitudes[k - 1]);
+    }
+    if (_grad_threshold > 0) {
+      cutoff = _topk_ratio < 1 ? std::min(cutoff, _grad_threshold)
+                               : _grad_threshold;
+    }
+    return cutoff;
+  }
+
+  /**
+   * @brief keys are sorted and delta-encoded, grads follow in the
+   * same order
+   */
+  void encode_grads(std::vector<push_val_t> &grads, BinaryBuffer &bb) {
+    std::vector<size_t> order(grads.size());
+    for (size_t i = 0; i < order.size(); i++)
+      order[i] = i;
+    std::sort(order.begin(), order.end(), [&grads](size_t a, size_t b) {
+      return grads[a].first < grads[b].first;
+    });
+    std::vector<key_t> keys;
+    keys.reserve(order.size());
+    for (size_t i : order)
+      keys.push_back(grads[i].first);
+    bb.put_delta_block(keys);
+    for (size_t i : order) {
+      bb << grads[i].second; // grad value
+    }
+  }
 
   size_t send(std::map<int, std::vector<push_val_t>> &items,
-              voidf_t extra_rsp_callback) {
+              voidf_t extra_rsp_callback,
+              int message_class = WORKER_PUSH_REQUEST) {
     size_t num_reqs = 0;
     for (auto &item : items) {
       if (item.second.empty())
         continue;
       num_reqs++;
       int node_id = item.first;
-      auto &grads = item.second;
-
       Request req;
-      req.meta.message_class = WORKER_PUSH_REQUEST;
-      for (auto &grad : grads) {
-        // RAW_LOG_INFO("push to node %d key:%d\t", node_id, grad.first);
-        req.cont << grad.first;  // key
-        req.cont << grad.second; // grad value
-      }
+      req.meta.message_class = message_class;
+      encode_grads(item.second, req.cont);
       // nothing to do after grads are pushed
       req.call_back_handler = [extra_rsp_callback](
           std::shared_ptr<Request> rsp) {
@@ -97,6 +330,11 @@ protected:
 
 private:
   Transfer<ServerWorkerRoute> &gtransfer;
+  // sparse push
+  float _grad_threshold = 0;
+  float _topk_ratio = 1;
+  std::atomic<size_t> _num_candidates{0};
+  std::atomic<size_t> _num_pushed{0};
 }; // end class GlobalPushAccess
 
 template <class Key, class Val, class Grad>
@@ -0,0 +1,143 @@
+#pragma once
+#include "../utils/all.h"
+#include "param.h"
+namespace swift_snails {
+/**
+ * @brief mutexes split by hash, a key locks one of them
+ */
+class StripedLock : public VirtualObject {
+public:
+  explicit StripedLock(size_t num_stripes = 64) : _muts(num_stripes) {
+    CHECK_GT(num_stripes, 0);
+  }
+  size_t stripe_of(size_t hash) const { return hash % _muts.size(); }
+  std::mutex &at(size_t stripe) { return _muts[stripe]; }
+  size_t size() const { return _muts.size(); }
+
+private:
+  std::vector<std::mutex> _muts;
+}; // end class StripedLock
+
+/**
+ * @brief grads of a training thread, merged into a shared
+ * `LocalParamCache` once the thread finishes its part of a minibatch
+ *
+ * threads no longer write the same grad rows while they train, the
+ * merges of different threads go on together as each stripe of keys is
+ * locked apart.
+ *
+ * @param Key key
+ * @param Grad local gradient type, with `merge(const Grad &)`
+ */
+template <typename Key, typename Grad> class GradBuffer : public VirtualObject {
+public:
+  typedef Key key_t;
+  typedef Grad grad_t;
+
+  GradBuffer() { _grads.set_empty_key(std::numeric_limits<key_t>::max()); }
+
+  grad_t &operator[](const key_t &key) { return _grads[key]; }
+  /**
+   * @brief add the grads to `cache` and clear the buffer
+   */
+  template <class Val>
+  void merge_into(LocalParamCache<key_t, Val, grad_t> &cache,
+                  StripedLock &locks) {
+    std::vector<std::vector<typename grads_t::iterator>> stripes(locks.size());
+    for (auto it = _grads.begin(); it != _grads.end(); ++it)
+      stripes[locks.stripe_of(std::hash<key_t>()(it->first))].push_back(it);
+    std::vector<typename grads_t::iterator> missing;
+    {
+      // rows are looked up by every thread, but inserted by one at a time
+      rwlock_read_guard lk(cache.rwlock());
+      for (size_t s = 0; s < stripes.size(); s++) {
+        if (stripes[s].empty())
+          continue;
+        std::lock_guard<std::mutex> stripe_lk(locks.at(s));
+        for (auto &it : stripes[s]) {
+          grad_t *grad = cache.find_grad(it->first);
+          if (grad == nullptr)
+            missing.push_back(it);
+          else
+            grad->merge(it->second);
+        }
+      }
+    }
+    if (!missing.empty()) {
+      rwlock_write_guard lk(cache.rwlock());
+      for (auto &it : missing)
+        cache.grads()[it->first].merge(it->second);
+    }
+    _grads.clear();
+  }
+
+private:
+  typedef dense_hash_map<key_t, grad_t> grads_t;
+  grads_t _grads;
+}; // end class GradBuffer
+
+/**
+ * @brief grads of a training thread by the slots of a `SlotParamCache`
+ *
+ * the thread pushes its own grads, so no row is written by two threads.
+ * Only the rows of the slots written are kept, packed in an array that
+ * is reused after `clear()`. It can be pushed from like a cache.
+ *
+ * @param Cache `SlotParamCache`
+ */
+template <typename Cache> class SlotGradBuffer : public VirtualObject {
+public:
+  typedef typename Cache::key_t key_t;
+  typedef typename Cache::grad_t grad_t;
+
+  explicit SlotGradBuffer(Cache &cache) : _cache(cache) {}
+
+  grad_t &grad(int slot) {
+    if (slot >= (int)_rows.size())
+      _rows.resize(std::max<size_t>(slot + 1, _cache.size()), -1);
+    int &row = _rows[slot];
+    if (row < 0) {
+      row = _slots.size();
+      _slots.push_back(slot);
+      if (_grads.size() < _slots.size())
+        _grads.emplace_back();
+    }
+    return _grads[row];
+  }
+  /**
+   * @brief keys of the slots written since the last `clear()`
+   */
+  void keys(std::unordered_set<key_t> &keys) const {
+    keys.clear();
+    for (int slot : _slots)
+      keys.insert(_cache.key(slot));
+  }
+  /**
+   * @brief drop the grads, the rows are kept to be reused
+   */
+  void clear() {
+    for (size_t i = 0; i < _slots.size(); i++) {
+      _rows[_slots[i]] = -1;
+      _grads[i].reset();
+    }
+    _slots.clear();
+  }
+
+  grad_t *find_grad(const key_t &key) {
+    int slot = _cache.slot(key);
+    if (slot < 0 || slot >= (int)_rows.size() || _rows[slot] < 0)
+      return nullptr;
+    return &_grads[_rows[slot]];
+  }
+  RWLock &rwlock() { return _rwlock; }
+
+private:
+  Cache &_cache;
+  RWLock _rwlock;
+  // row of each slot in `_grads`, -1 if not written
+  std::vector<int> _rows;
+  std::vector<int> _slots;
+  std::vector<grad_t> _grads;
+}; // end class SlotGradBuffer
+
+}; // end namespace swift_snails
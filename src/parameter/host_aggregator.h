@@ -0,0 +1,152 @@
+#pragma once
+#include "../utils/all.h"
+#include "../cluster/message_classes.h"
+#include "../cluster/worker.h"
+#include "param.h"
+#include "push_combiner.h"
+#include "shared_pull_cache.h"
+namespace swift_snails {
+/**
+ * @brief combiner of the pulls and pushes of the workers on a host
+ *
+ * with `host_aggregation` on, the worker of the lowest rank on a host is
+ * the leader, the other workers on the host send their pulls and pushes
+ * to it rather than to the servers. The leader deduplicates the keys of
+ * concurrent pulls with a SharedPullCache, and merges the grads with a
+ * PushCombiner which pushes once every other worker on the host has
+ * pushed since the last push. A pull is answered once its values arrive,
+ * no handler thread waits for the servers.
+ *
+ * Usage:
+ *
+ *  cluster.initialize();
+ *  HostAggregator<Key, Val, Grad> aggregator;
+ *  ... train ...
+ *  aggregator.finalize();
+ *
+ * @warning the leader waits for the servers in its push handler, so the
+ * worker should have a response lane, see `response_exec_num`
+ */
+template <typename Key, typename Val, typename Grad>
+class HostAggregator : public VirtualObject {
+public:
+  typedef Key key_t;
+  typedef Val val_t;
+  typedef Grad grad_t;
+  typedef LocalParamCache<key_t, val_t, grad_t> param_cache_t;
+  typedef ClusterWorker::transfer_t transfer_t;
+
+  /**
+   * @warning a collective, every rank should construct it after the
+   * cluster is initialized
+   */
+  HostAggregator()
+      : _enabled(
+            global_config().get("cluster", "host_aggregation", "0").to_int32() >
+            0) {
+    const int rank = global_mpi().rank();
+    if (_enabled && global_worker().is_valid() &&
+        global_mpi().host_leader(rank) == rank &&
+        global_mpi().host_size(rank) > 1) {
+      CHECK_GT(
+          global_config().get("worker", "response_exec_num", "0").to_int32(),
+          0)
+          << "host aggregator needs a response lane";
+      _shared_cache.reset(new SharedPullCache<key_t, val_t, grad_t>(_cache));
+      _num_members = global_mpi().host_size(rank) - 1;
+      // pushed by the push handler once every member has pushed
+      _combiner.reset(new PushCombiner<key_t, val_t, grad_t>(0));
+      init_pull_method();
+      init_push_method();
+      LOG(WARNING) << "host aggregator of " << global_mpi().host_size(rank)
+                   << " ranks at " << global_mpi().ip(rank);
+    }
+    // members send only after the leaders have their handlers
+    global_mpi().barrier();
+  }
+  /**
+   * @brief push the grads merged since the last push
+   * @warning a collective, every worker should have finished pushing
+   */
+  void finalize() {
+    global_mpi().barrier();
+    if (_combiner)
+      _combiner->flush();
+    global_mpi().barrier();
+  }
+  // whether the local worker aggregates for its host
+  bool is_leader() const { return (bool)_combiner; }
+
+protected:
+  void init_pull_method() {
+    transfer_t::msgcls_handler_t handler = [this](std::shared_ptr<Request> req,
+                                                  Request &) {
+      auto keys = std::make_shared<std::vector<key_t>>();
+      req->cont.get_delta_block(*keys);
+      auto key_set = std::make_shared<std::unordered_set<key_t>>(
+          keys->begin(), keys->end());
+      // keys in flight for another member are not pulled again, the
+      // response is left empty and sent once the values are in the cache
+      _shared_cache->acquire_async(*key_set, [this, req, keys, key_set] {
+        Request reply;
+        {
+          rwlock_read_guard lk(_cache.rwlock());
+          auto &params = _cache.params();
+          for (const key_t &key : *keys)
+            reply.cont << params[key];
+        }
+        _shared_cache->release(*key_set);
+        global_worker().transfer().respond(*req, std::move(reply));
+      });
+    };
+    global_worker().transfer().message_class().add(WORKER_HOST_PULL_REQUEST,
+                                                   std::move(handler));
+  }
+
+  void init_push_method() {
+    transfer_t::msgcls_handler_t handler = [this](std::shared_ptr<Request> req,
+                                                  Request &rsp) {
+      std::vector<key_t> keys;
+      req->cont.get_delta_block(keys);
+      param_cache_t member_cache;
+      auto &grads = member_cache.grads();
+      grad_t grad;
+      for (const key_t &key : keys) {
+        req->cont >> grad;
+        grads[key] = grad;
+      }
+      _combiner->deposit(
+          std::unordered_set<key_t>(keys.begin(), keys.end()), member_cache);
+      // a member pushes once per thread, the round ends when every
+      // member has pushed at least once
+      bool to_flush = false;
+      {
+        std::lock_guard<std::mutex> lk(_round_mut);
+        _round_members.insert(req->meta.client_id);
+        if ((int)_round_members.size() >= _num_members) {
+          _round_members.clear();
+          to_flush = true;
+        }
+      }
+      if (to_flush)
+        _combiner->flush();
+      rsp.cont << 1234;
+    };
+    global_worker().transfer().message_class().add(WORKER_HOST_PUSH_REQUEST,
+                                                   std::move(handler));
+  }
+
+private:
+  bool _enabled;
+  // values pulled for the members
+  param_cache_t _cache;
+  std::unique_ptr<SharedPullCache<key_t, val_t, grad_t>> _shared_cache;
+  std::unique_ptr<PushCombiner<key_t, val_t, grad_t>> _combiner;
+  // number of the other workers on the host
+  int _num_members = 0;
+  // members pushed since the last combined push
+  std::set<int> _round_members;
+  std::mutex _round_mut;
+}; // end class HostAggregator
+
+}; // end namespace swift_snails
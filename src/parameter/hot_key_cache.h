@@ -0,0 +1,232 @@
+#pragma once
+#include "../utils/all.h"
+#include "../transfer/transfer.h"
+#include "../cluster/message_classes.h"
+#include "../cluster/hashfrag.h"
+#include "../cluster/worker.h"
+#include "param.h"
+namespace swift_snails {
+/**
+ * @brief worker-side replica of the hot keys of every server
+ *
+ * every server reports the keys it is accessed most with their values,
+ * the worker serves pulls of those keys from the replica, and keeps
+ * their grads to push at the next refresh. The replica is refreshed once
+ * it is older than `hot_key_staleness_ms`, so the values read are never
+ * staler than that.
+ *
+ * The hits of the replica are reported at refresh, to keep the keys
+ * hot on the servers though they are pulled no more.
+ *
+ * @param Key key
+ * @param Val local parameter type
+ * @param Grad local gradient type, with `merge(const Grad &)`
+ */
+template <typename Key, typename Val, typename Grad>
+class HotKeyCache : public VirtualObject {
+public:
+  typedef Key key_t;
+  typedef Val val_t;
+  typedef Grad grad_t;
+  typedef std::pair<key_t, grad_t> push_val_t;
+  typedef LocalParamCache<key_t, val_t, grad_t> param_cache_t;
+
+  HotKeyCache()
+      : gtransfer(global_worker().transfer()),
+        _staleness(global_config()
+                       .get("worker", "hot_key_staleness_ms", "0")
+                       .to_int32()) {
+    CHECK_GE(_staleness, 0);
+    _deferred.set_empty_key(std::numeric_limits<key_t>::max());
+  }
+  // hot keys are pulled from the servers like the others if disabled
+  bool enabled() const { return _staleness > 0; }
+  /**
+   * @brief write the values of the hot keys in `keys` to `param_cache`
+   *
+   * @param misses keys not in the replica, to pull from the servers
+   */
+  template <class Cache>
+  void serve(const std::unordered_set<key_t> &keys, Cache &param_cache,
+             std::unordered_set<key_t> &misses) {
+    if (stale()) {
+      std::unique_lock<std::mutex> lk(_refresh_mut, std::try_to_lock);
+      // another thread is refreshing, the replica may be too stale
+      if (!lk.owns_lock()) {
+        misses = keys;
+        return;
+      }
+      if (stale())
+        refresh();
+    }
+    std::vector<key_t> hits;
+    {
+      rwlock_read_guard lk(_replica.rwlock());
+      rwlock_write_guard cache_lk(param_cache.rwlock());
+      auto &replica = _replica.params();
+      for (const key_t &key : keys) {
+        auto it = replica.find(key);
+        if (it == replica.end()) {
+          misses.insert(key);
+          continue;
+        }
+        param_cache.set_param(key, val_t(it->second));
+        hits.push_back(key);
+      }
+    }
+    std::lock_guard<std::mutex> lk(_deferred_mut);
+    for (const key_t &key : hits)
+      _hits[key]++;
+  }
+  /**
+   * @brief take the grads of hot keys out of a push, they are pushed
+   * with the next refresh, nodes left with no grads are erased
+   */
+  void defer(std::map<int, std::vector<push_val_t>> &node_reqs) {
+    rwlock_read_guard lk(_replica.rwlock());
+    std::lock_guard<std::mutex> deferred_lk(_deferred_mut);
+    auto &replica = _replica.params();
+    for (auto it = node_reqs.begin(); it != node_reqs.end();) {
+      auto &grads = it->second;
+      size_t kept = 0;
+      for (size_t i = 0; i < grads.size(); i++) {
+        if (replica.find(grads[i].first) != replica.end()) {
+          _deferred[grads[i].first].merge(grads[i].second);
+          continue;
+        }
+        if (kept != i)
+          grads[kept] = std::move(grads[i]);
+        kept++;
+      }
+      grads.resize(kept);
+      if (grads.empty())
+        it = node_reqs.erase(it);
+      else
+        ++it;
+    }
+  }
+  /**
+   * @brief push the deferred grads, should be called after training
+   */
+  void flush() {
+    if (!enabled())
+      return;
+    std::lock_guard<std::mutex> lk(_refresh_mut);
+    refresh();
+  }
+
+protected:
+  bool stale() const {
+    return now_ms() - _stamp.load() >= (int64_t)_staleness;
+  }
+
+  static int64_t now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+  /**
+   * @brief push the deferred grads and hits to every server, and replace
+   * the replica with the hot keys they answer
+   * @warning `_refresh_mut` should be held
+   */
+  void refresh() {
+    std::map<int, std::vector<push_val_t>> node_grads;
+    std::map<int, std::vector<std::pair<key_t, size_t>>> node_hits;
+    {
+      std::lock_guard<std::mutex> lk(_deferred_mut);
+      auto &hashfrag = global_hashfrag<key_t>();
+      for (auto &item : _deferred)
+        node_grads[hashfrag.to_node_id(item.first)].emplace_back(item.first,
+                                                                 item.second);
+      for (auto &item : _hits)
+        node_hits[hashfrag.to_node_id(item.first)].emplace_back(item.first,
+                                                                item.second);
+      _deferred.clear();
+      _hits.clear();
+    }
+    const auto &server_ids = global_route().server_ids();
+    StateBarrier barrier;
+    std::atomic<size_t> num_reqs{server_ids.size()};
+    std::mutex replica_mut;
+    param_cache_t replica;
+    for (int node_id : server_ids) {
+      Request req;
+      req.meta.message_class = WORKER_HOT_KEYS_REQUEST;
+      encode(node_grads[node_id], node_hits[node_id], req.cont);
+      req.call_back_handler = [&barrier, &num_reqs, &replica, &replica_mut](
+          std::shared_ptr<Request> rsp) {
+        CHECK(rsp->cont.get<bool>());
+        std::vector<key_t> keys;
+        rsp->cont.get_delta_block(keys);
+        val_t val;
+        {
+          std::lock_guard<std::mutex> lk(replica_mut);
+          auto &params = replica.params();
+          for (const key_t &key : keys) {
+            rsp->cont >> val;
+            params[key] = std::move(val);
+          }
+        }
+        CHECK(rsp->cont.read_finished());
+        if (--num_reqs == 0) {
+          barrier.set_state_valid();
+          barrier.try_unblock();
+        }
+      };
+      gtransfer.send(std::move(req), node_id);
+    }
+    if (!server_ids.empty())
+      barrier.block();
+    {
+      rwlock_write_guard lk(_replica.rwlock());
+      _replica.params().swap(replica.params());
+    }
+    _stamp = now_ms();
+  }
+  /**
+   * grads and hits are sorted by key and delta-encoded
+   */
+  static void encode(std::vector<push_val_t> &grads,
+                     std::vector<std::pair<key_t, size_t>> &hits,
+                     BinaryBuffer &bb) {
+    std::sort(grads.begin(), grads.end(),
+              [](const push_val_t &a, const push_val_t &b) {
+                return a.first < b.first;
+              });
+    std::vector<key_t> keys;
+    keys.reserve(grads.size());
+    for (const auto &item : grads)
+      keys.push_back(item.first);
+    bb.put_delta_block(keys);
+    for (auto &item : grads)
+      bb << item.second;
+    std::sort(hits.begin(), hits.end());
+    keys.clear();
+    for (const auto &item : hits)
+      keys.push_back(item.first);
+    bb.put_delta_block(keys);
+    for (const auto &item : hits)
+      bb.put_varint(item.second);
+  }
+
+private:
+  Transfer<ServerWorkerRoute> &gtransfer;
+  int _staleness;
+  // values of the hot keys, only the parameters are used
+  param_cache_t _replica;
+  std::atomic<int64_t> _stamp{0};
+  std::mutex _refresh_mut;
+  // grads of hot keys and hits of the replica since the last refresh
+  dense_hash_map<key_t, grad_t> _deferred;
+  std::unordered_map<key_t, size_t> _hits;
+  std::mutex _deferred_mut;
+}; // end class HotKeyCache
+
+template <class Key, class Val, class Grad>
+HotKeyCache<Key, Val, Grad> &global_hot_key_cache() {
+  static HotKeyCache<Key, Val, Grad> cache;
+  return cache;
+}
+
+}; // end namespace swift_snails
@@ -0,0 +1,59 @@
+#pragma once
+#include "../utils/all.h"
+namespace swift_snails {
+/**
+ * @brief when a training thread in the local SGD mode syncs with the
+ * servers
+ *
+ * in the local SGD mode a thread applies its grads to the local cache
+ * and keeps accumulating them, it pushes the grads and pulls fresh
+ * values once every `local_sgd_steps` minibatches, or once
+ * `local_sgd_ms` passed since the last sync, whichever comes first.
+ */
+class LocalSGDSchedule : public VirtualObject {
+public:
+  LocalSGDSchedule()
+      : _steps(
+            global_config().get("worker", "local_sgd_steps", "0").to_int32()),
+        _ms(global_config().get("worker", "local_sgd_ms", "0").to_int32()) {
+    CHECK_GE(_steps, 0);
+    CHECK_GE(_ms, 0);
+    _last_sync = now_ms();
+  }
+  /**
+   * @brief whether grads are applied locally between syncs, if not every
+   * minibatch syncs
+   */
+  bool enabled() const { return _steps > 1 || _ms > 0; }
+  /**
+   * @brief a minibatch is trained
+   * @return whether to sync
+   */
+  bool step() {
+    if (!enabled())
+      return true;
+    _num_steps++;
+    bool to_sync = (_steps > 0 && _num_steps >= _steps) ||
+                   (_ms > 0 && now_ms() - _last_sync >= _ms);
+    if (to_sync) {
+      _num_steps = 0;
+      _last_sync = now_ms();
+    }
+    return to_sync;
+  }
+
+protected:
+  static int64_t now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+private:
+  int _steps;
+  int _ms;
+  int _num_steps = 0;
+  int64_t _last_sync;
+}; // end class LocalSGDSchedule
+
+}; // end namespace swift_snails
@@ -0,0 +1,109 @@
+#pragma once
+#include "../utils/all.h"
+namespace swift_snails {
+/**
+ * @brief milliseconds a minibatch spends in each phase
+ *
+ * in the prefetch modes `pull` is the time waiting for the prefetched
+ * values, which is the part of the pull not hidden by compute.
+ */
+struct BatchTimes {
+  double gather = 0;
+  double pull = 0;
+  double compute = 0;
+  double push = 0;
+
+  double comm() const { return gather + pull + push; }
+  void clear() { gather = pull = compute = push = 0; }
+};
+/**
+ * @brief adjust the minibatch size to the measured ratio of
+ * communication to compute time
+ *
+ * a bigger minibatch shares the round trips and the keys among more
+ * lines, a smaller one keeps parameters fresher. The ratio is smoothed
+ * over minibatches, once every `window` minibatches the size grows by
+ * half if the ratio is above `minibatch_comm_ratio`, and shrinks by a
+ * fifth if it is below half of it, within `minibatch_min` and
+ * `minibatch_max`, which bounds the keys held by the cache.
+ *
+ * Every change is logged with the times it is made from.
+ */
+class MiniBatchTuner : public VirtualObject {
+public:
+  /**
+   * @param minibatch initial size
+   */
+  explicit MiniBatchTuner(int minibatch)
+      : MiniBatchTuner(
+            minibatch,
+            global_config().get("worker", "minibatch_min", "1").to_int32(),
+            global_config().get("worker", "minibatch_max", "0").to_int32(),
+            global_config()
+                .get("worker", "minibatch_comm_ratio", "0.5")
+                .to_float()) {}
+  /**
+   * @param max_size 0 to keep the size fixed
+   * @param target communication to compute ratio tuned to
+   */
+  MiniBatchTuner(int minibatch, int min_size, int max_size, float target)
+      : _size(minibatch), _min_size(min_size), _max_size(max_size),
+        _target(target) {
+    CHECK_GT(_size, 0);
+    if (enabled()) {
+      CHECK_GT(_min_size, 0);
+      CHECK_LE(_min_size, _max_size);
+      CHECK_GT(_target, 0);
+      _size = std::min(std::max(_size, _min_size), _max_size);
+    }
+  }
+  // the size is fixed if disabled
+  bool enabled() const { return _max_size > 0; }
+  int size() const { return _size; }
+  /**
+   * @brief record the times of a minibatch
+   * @return size of the next minibatch
+   */
+  int update(const BatchTimes &times) {
+    if (!enabled() || times.compute <= 0)
+      return _size;
+    const double ratio = times.comm() / times.compute;
+    _ratio = _ratio < 0 ? ratio : 0.7 * _ratio + 0.3 * ratio;
+    _sum.gather += times.gather;
+    _sum.pull += times.pull;
+    _sum.compute += times.compute;
+    _sum.push += times.push;
+    if (++_num_batches < window)
+      return _size;
+    int size = _size;
+    if (_ratio > _target)
+      size = std::min(int(_size * 1.5), _max_size);
+    else if (_ratio < _target / 2)
+      size = std::max(int(_size * 0.8), _min_size);
+    if (size != _size) {
+      LOG(INFO) << "minibatch size " << _size << " -> " << size
+                << "\tcomm/compute " << _ratio << "\tavg ms gather "
+                << _sum.gather / _num_batches << " pull "
+                << _sum.pull / _num_batches << " compute "
+                << _sum.compute / _num_batches << " push "
+                << _sum.push / _num_batches;
+      _size = size;
+    }
+    _num_batches = 0;
+    _sum.clear();
+    return _size;
+  }
+
+private:
+  static const int window = 4;
+  int _size;
+  int _min_size;
+  int _max_size;
+  float _target;
+  // smoothed communication to compute ratio, < 0 before the first
+  double _ratio = -1;
+  int _num_batches = 0;
+  BatchTimes _sum;
+}; // end class MiniBatchTuner
+
+}; // end namespace swift_snails
@@ -20,13 +20,25 @@ public:
     _params.set_empty_key(std::numeric_limits<key_t>::max());
     _grads.set_empty_key(std::numeric_limits<key_t>::max());
   }
+  /**
+   * @brief allow `erase()`, `deleted_key` can not be used as a key then
+   */
+  void enable_erase(const key_t &deleted_key) {
+    rwlock_write_guard lk(_rwlock);
+    _params.set_deleted_key(deleted_key);
+    _grads.set_deleted_key(deleted_key);
+    _erasable = true;
+    _deleted_key = deleted_key;
+  }
 
   void init_keys(std::unordered_set<key_t> &keys) {
     rwlock_write_guard lk(_rwlock);
 
     for (auto &key : keys) {
       _params[key] = param_t();
-      _grads[key] = grad_t();
+      // residual grads of a sparse push are kept
+      if (_grads.find(key) == _grads.end())
+        _grads[key] = grad_t();
     }
   }
 
@@ -36,6 +48,62 @@ public:
     _grads.clear();
   }
 
+  /**
+   * @brief clear parameters but keep the local grads
+   *
+   * only the grads holding a residual are kept, so the rows do not pile
+   * up across minibatches.
+   */
+  void clear_params() {
+    rwlock_write_guard lk(_rwlock);
+    _params.clear();
+    dense_hash_map<key_t, grad_t> grads;
+    grads.set_empty_key(std::numeric_limits<key_t>::max());
+    if (_erasable)
+      grads.set_deleted_key(_deleted_key);
+    for (auto &item : _grads)
+      if (item.second.magnitude() > 0)
+        grads[item.first] = item.second;
+    _grads.swap(grads);
+  }
+  /**
+   * @brief keys with a grad row
+   */
+  void grad_keys(std::unordered_set<key_t> &keys) {
+    rwlock_read_guard lk(_rwlock);
+    keys.clear();
+    for (auto &item : _grads)
+      keys.insert(item.first);
+  }
+
+  /**
+   * @brief write a pulled value, the residual grad of the key is kept
+   * @warning the write lock should be held
+   */
+  void set_param(const key_t &key, param_t &&param) {
+    _params[key] = std::move(param);
+    if (_grads.find(key) == _grads.end())
+      _grads[key] = grad_t();
+  }
+  /**
+   * @brief grad of a key, nullptr if it is not in the cache
+   */
+  grad_t *find_grad(const key_t &key) {
+    auto it = _grads.find(key);
+    return it == _grads.end() ? nullptr : &it->second;
+  }
+  /**
+   * @brief drop the row of a key
+   * @param keep_grad keep the residual grad to push it later
+   */
+  void erase(const key_t &key, bool keep_grad = false) {
+    CHECK(_erasable) << "enable_erase() should be called first";
+    rwlock_write_guard lk(_rwlock);
+    _params.erase(key);
+    if (!keep_grad)
+      _grads.erase(key);
+  }
+
   size_t size() const {
     rwlock_read_guard lk(_rwlock);
     return _params.size();
@@ -59,12 +127,103 @@ public:
   std::set<key_t> &local_keys() { return _local_keys; }
 
 private:
-  RWLock _rwlock;
+  mutable RWLock _rwlock;
   // parameter cache
   dense_hash_map<key_t, param_t> _params;
   // gradient cache
   dense_hash_map<key_t, grad_t> _grads;
   std::set<key_t> _local_keys;
+  // set by enable_erase()
+  bool _erasable = false;
+  key_t _deleted_key = key_t();
+};
+/**
+ * @brief local parameter cache with rows in arrays
+ *
+ * keys are mapped to slots once by `init_keys()`, parameters and grads
+ * of a slot sit at the same index of two arrays, so an instance whose
+ * keys are translated to slots is trained by plain indexing. The rows are
+ * reused by the next `init_keys()` without reallocation.
+ *
+ * It can be pulled to and pushed from like `LocalParamCache`.
+ *
+ * @warning grads are reset by `init_keys()`, residual grads of sparse
+ * push are dropped
+ */
+template <typename Key, typename Param, typename Grad> class SlotParamCache {
+public:
+  typedef Key key_t;
+  typedef Param param_t;
+  typedef Grad grad_t;
+
+  explicit SlotParamCache() {
+    _slots.set_empty_key(std::numeric_limits<key_t>::max());
+  }
+  /**
+   * @brief map `keys` to slots, the previous keys are dropped
+   */
+  void init_keys(const std::unordered_set<key_t> &keys) {
+    rwlock_write_guard lk(_rwlock);
+    _slots.clear();
+    _keys.assign(keys.begin(), keys.end());
+    for (size_t i = 0; i < _keys.size(); i++)
+      _slots[_keys[i]] = i;
+    if (_params.size() < _keys.size()) {
+      _params.resize(_keys.size());
+      _grads.resize(_keys.size());
+    }
+    for (size_t i = 0; i < _keys.size(); i++)
+      _grads[i].reset();
+  }
+  /**
+   * @brief slot of a key, -1 if it is not in the cache
+   */
+  int slot(const key_t &key) const {
+    auto it = _slots.find(key);
+    return it == _slots.end() ? -1 : it->second;
+  }
+  /**
+   * @brief translate keys to slots, keys not in the cache are -1
+   */
+  void translate(const std::vector<key_t> &keys,
+                 std::vector<int> &slots) const {
+    slots.resize(keys.size());
+    for (size_t i = 0; i < keys.size(); i++)
+      slots[i] = slot(keys[i]);
+  }
+  /**
+   * @warning not thread-safe
+   */
+  param_t &param(int slot) { return _params[slot]; }
+  grad_t &grad(int slot) { return _grads[slot]; }
+  const key_t &key(int slot) const { return _keys[slot]; }
+  /**
+   * @brief write a pulled value
+   * @warning the write lock should be held
+   */
+  void set_param(const key_t &key, param_t &&param) {
+    int id = slot(key);
+    CHECK_GE(id, 0) << "pull a key not in the cache";
+    _params[id] = std::move(param);
+  }
+  grad_t *find_grad(const key_t &key) {
+    int id = slot(key);
+    return id < 0 ? nullptr : &_grads[id];
+  }
+
+  size_t size() const {
+    rwlock_read_guard lk(_rwlock);
+    return _keys.size();
+  }
+  RWLock &rwlock() { return _rwlock; }
+
+private:
+  mutable RWLock _rwlock;
+  dense_hash_map<key_t, int> _slots;
+  std::vector<key_t> _keys;
+  // rows beyond the keys are kept to be reused
+  std::vector<param_t> _params;
+  std::vector<grad_t> _grads;
 };
 
 }; // end namespace swift_snails
@@ -0,0 +1,142 @@
+#pragma once
+#include "../utils/all.h"
+#include "param.h"
+#include "global_pull_access.h"
+#include "global_push_access.h"
+namespace swift_snails {
+/**
+ * @brief pull the next minibatch and push the last one in the background
+ * while the current one is trained
+ *
+ * three caches take turns: the one in training, the one the next
+ * minibatch is pulled into, and the one the last minibatch is pushed
+ * from. A cache is pulled into again only after its push is answered,
+ * which has the whole training of a minibatch to finish.
+ *
+ * The next minibatch is pulled before the grads of the current one are
+ * pushed, so it reads parameters one or two minibatches stale.
+ *
+ * The requests are sent by the training thread and finished by the
+ * response callbacks of the transfer, no thread is started for them.
+ *
+ * Usage:
+ *
+ *  prefetch(keys of minibatch 0)
+ *  next()
+ *  while more:
+ *    prefetch(keys of minibatch k + 1)
+ *    train on cache()
+ *    next()
+ *  train on cache()
+ *  flush()
+ *
+ * @param Key key
+ * @param Val local parameter type
+ * @param Grad local gradient type
+ */
+template <typename Key, typename Val, typename Grad>
+class ParamPrefetcher : public VirtualObject {
+public:
+  typedef Key key_t;
+  typedef Val val_t;
+  typedef Grad grad_t;
+  typedef LocalParamCache<key_t, val_t, grad_t> param_cache_t;
+
+  ParamPrefetcher()
+      : _pull_access(global_pull_access<key_t, val_t, grad_t>()),
+        _push_access(global_push_access<key_t, val_t, grad_t>()) {}
+
+  ~ParamPrefetcher() {
+    for (auto &slot : _slots) {
+      wait(slot.pull);
+      wait(slot.push);
+    }
+  }
+  /**
+   * @brief start to pull the keys of the next minibatch
+   */
+  void prefetch(std::unordered_set<key_t> &&keys) {
+    Slot &slot = _slots[(_cur + 1) % num_slots];
+    wait(slot.pull);
+    wait(slot.push);
+    // residual grads of sparse push should be kept
+    if (_push_access.keeps_residual())
+      slot.cache.clear_params();
+    else
+      slot.cache.clear();
+    slot.keys = std::move(keys);
+    slot.cache.init_keys(slot.keys);
+    slot.pull = std::make_shared<StateBarrier>();
+    _pull_access.pull_async(slot.keys, slot.cache, unblock(slot.pull));
+  }
+  /**
+   * @brief start to push the current minibatch, and wait for the pull of
+   * the prefetched one
+   */
+  void next() {
+    if (_started)
+      push_async(_slots[_cur]);
+    _cur = (_cur + 1) % num_slots;
+    wait(_slots[_cur].pull);
+    _started = true;
+  }
+  /**
+   * @brief push the current minibatch and wait for every request, then
+   * push the residuals held in the caches
+   */
+  void flush() {
+    if (_started)
+      push_async(_slots[_cur]);
+    for (auto &slot : _slots) {
+      wait(slot.pull);
+      wait(slot.push);
+    }
+    for (auto &slot : _slots)
+      _push_access.flush_residuals(slot.cache);
+    _started = false;
+  }
+  /**
+   * @brief cache of the minibatch in training
+   */
+  param_cache_t &cache() { return _slots[_cur].cache; }
+
+protected:
+  struct Slot {
+    param_cache_t cache;
+    std::unordered_set<key_t> keys;
+    // unblocked once the request in flight is answered
+    std::shared_ptr<StateBarrier> pull;
+    std::shared_ptr<StateBarrier> push;
+  };
+
+  void push_async(Slot &slot) {
+    wait(slot.push);
+    slot.push = std::make_shared<StateBarrier>();
+    _push_access.push_async(slot.keys, slot.cache, unblock(slot.push));
+  }
+
+  static voidf_t unblock(std::shared_ptr<StateBarrier> barrier) {
+    return [barrier] {
+      barrier->set_state_valid();
+      barrier->try_unblock();
+    };
+  }
+
+  static void wait(std::shared_ptr<StateBarrier> &barrier) {
+    if (!barrier)
+      return;
+    barrier->block();
+    barrier.reset();
+  }
+
+private:
+  static const int num_slots = 3;
+  GlobalPullAccess<key_t, val_t, grad_t> &_pull_access;
+  GlobalPushAccess<key_t, val_t, grad_t> &_push_access;
+  Slot _slots[num_slots];
+  int _cur = 0;
+  // whether a minibatch is in training
+  bool _started = false;
+}; // end class ParamPrefetcher
+
+}; // end namespace swift_snails
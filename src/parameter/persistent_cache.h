@@ -0,0 +1,174 @@
+#pragma once
+#include "../utils/all.h"
+#include "param.h"
+#include "global_pull_access.h"
+#include "global_push_access.h"
+namespace swift_snails {
+/**
+ * @brief the rows of a cache from the most to the least recently used,
+ * each stamped with the minibatch it was pulled in
+ *
+ * @param Key key
+ */
+template <typename Key> class RowLRU : public VirtualObject {
+public:
+  typedef Key key_t;
+
+  /**
+   * @param staleness max number of minibatches a row is reused for
+   */
+  explicit RowLRU(int staleness) : _staleness(staleness) {
+    CHECK_GE(_staleness, 0);
+  }
+  /**
+   * @brief move the rows of `keys` to the front
+   * @param to_pull gets the keys missing or pulled more than `staleness`
+   * minibatches ago, they are stamped as pulled now
+   */
+  void touch(const std::unordered_set<key_t> &keys,
+             std::unordered_set<key_t> &to_pull) {
+    for (const key_t &key : keys) {
+      auto it = _rows.find(key);
+      if (it == _rows.end()) {
+        _lru.push_front(key);
+        _rows[key] = Row{_lru.begin(), _clock};
+        to_pull.insert(key);
+        continue;
+      }
+      // the most recent at the front
+      _lru.splice(_lru.begin(), _lru, it->second.pos);
+      if (_clock - it->second.stamp > _staleness) {
+        it->second.stamp = _clock;
+        to_pull.insert(key);
+      }
+    }
+  }
+  /**
+   * @brief drop the least recently used rows beyond `bound`
+   * @param evicted gets the keys dropped
+   */
+  void evict(size_t bound, std::vector<key_t> &evicted) {
+    while (_rows.size() > bound) {
+      const key_t key = _lru.back();
+      evicted.push_back(key);
+      _rows.erase(key);
+      _lru.pop_back();
+    }
+  }
+  // a minibatch passes
+  void tick() { _clock++; }
+  size_t size() const { return _rows.size(); }
+
+private:
+  struct Row {
+    typename std::list<key_t>::iterator pos;
+    // minibatch the row is pulled in
+    int stamp;
+  };
+
+  int _staleness;
+  std::list<key_t> _lru;
+  std::unordered_map<key_t, Row> _rows;
+  // number of minibatches passed
+  int _clock = 0;
+}; // end class RowLRU
+/**
+ * @brief worker-side parameter cache kept across minibatches
+ *
+ * every row is stamped with the minibatch it was pulled in, a minibatch
+ * only pulls the keys that are missing or were pulled more than
+ * `staleness` minibatches ago, so a key in every minibatch is pulled
+ * once every `staleness + 1` of them. The grads are pushed every
+ * minibatch as usual.
+ *
+ * Rows beyond `max_rows` are dropped, the least recently used first.
+ *
+ * @param Key key
+ * @param Val local parameter type
+ * @param Grad local gradient type
+ */
+template <typename Key, typename Val, typename Grad>
+class PersistentParamCache : public VirtualObject {
+public:
+  typedef Key key_t;
+  typedef Val val_t;
+  typedef Grad grad_t;
+  typedef LocalParamCache<key_t, val_t, grad_t> param_cache_t;
+
+  /**
+   * @param max_rows max number of rows kept
+   * @param staleness max number of minibatches a row is reused for
+   */
+  PersistentParamCache(size_t max_rows, int staleness)
+      : _max_rows(max_rows), _rows(staleness),
+        _pull_access(global_pull_access<key_t, val_t, grad_t>()),
+        _push_access(global_push_access<key_t, val_t, grad_t>()) {
+    CHECK_GT(_max_rows, 0);
+    // evicted rows are erased, only this cache reserves the key
+    _cache.enable_erase(std::numeric_limits<key_t>::max() - 1);
+  }
+  /**
+   * @brief make the rows of `keys` fresh, pulling the missing and the
+   * stale ones
+   */
+  void pull(const std::unordered_set<key_t> &keys) {
+    std::unordered_set<key_t> to_pull;
+    _rows.touch(keys, to_pull);
+    _num_keys += keys.size();
+    _num_pulled += to_pull.size();
+    _cache.init_keys(to_pull);
+    _pull_access.pull_with_barrier(to_pull, _cache);
+    evict(keys.size());
+  }
+  /**
+   * @brief push the grads of `keys`, a minibatch passes
+   */
+  void push(const std::unordered_set<key_t> &keys) {
+    _push_access.push_with_barrier(keys, _cache);
+    _rows.tick();
+  }
+  /**
+   * @brief push the residuals held in the cache, including the ones of
+   * evicted rows
+   */
+  void flush() { _push_access.flush_residuals(_cache); }
+
+  param_cache_t &cache() { return _cache; }
+  /**
+   * @brief ratio of keys pulled from the servers since the last call of
+   * `reset_stat()`
+   */
+  float pull_ratio() const {
+    return _num_keys > 0 ? float(_num_pulled) / _num_keys : 0;
+  }
+  void reset_stat() {
+    _num_keys = 0;
+    _num_pulled = 0;
+  }
+
+protected:
+  /**
+   * drop the least recently used rows beyond the budget, the keys of the
+   * current minibatch are at the front and kept
+   */
+  void evict(size_t num_in_use) {
+    const size_t bound = std::max(_max_rows, num_in_use);
+    // residual grads of sparse push are kept to be pushed later
+    const bool keep_grad = _push_access.keeps_residual();
+    std::vector<key_t> evicted;
+    _rows.evict(bound, evicted);
+    for (const key_t &key : evicted)
+      _cache.erase(key, keep_grad);
+  }
+
+private:
+  size_t _max_rows;
+  RowLRU<key_t> _rows;
+  GlobalPullAccess<key_t, val_t, grad_t> &_pull_access;
+  GlobalPushAccess<key_t, val_t, grad_t> &_push_access;
+  param_cache_t _cache;
+  size_t _num_keys = 0;
+  size_t _num_pulled = 0;
+}; // end class PersistentParamCache
+
+}; // end namespace swift_snails
@@ -0,0 +1,120 @@
+#pragma once
+#include "../utils/all.h"
+#include "param.h"
+#include "global_push_access.h"
+namespace swift_snails {
+/**
+ * @brief combine the pushes of the training threads in a worker process
+ *
+ * every thread deposits the grads of its minibatch instead of pushing
+ * them, grads of the same key from different threads are merged, and
+ * once `interval` deposits are made the depositing thread pushes the
+ * combined grads, so a key touched by all the threads is sent to its
+ * server once per interval. With interval 0 the owner decides when to
+ * push by `flush()`.
+ *
+ * Grad should have a `merge(const Grad &)` method to add another grad.
+ *
+ * @param Key key
+ * @param Val local parameter type
+ * @param Grad local gradient type
+ */
+template <typename Key, typename Val, typename Grad>
+class PushCombiner : public VirtualObject {
+public:
+  typedef Key key_t;
+  typedef Val val_t;
+  typedef Grad grad_t;
+  typedef LocalParamCache<key_t, val_t, grad_t> param_cache_t;
+  typedef GlobalPushAccess<key_t, val_t, grad_t> push_access_t;
+
+  /**
+   * @param interval number of deposits between two pushes, 0 to push
+   * only on `flush()`
+   */
+  explicit PushCombiner(int interval)
+      : _interval(interval),
+        _push_access(global_push_access<key_t, val_t, grad_t>()) {
+    CHECK_GE(_interval, 0);
+  }
+  /**
+   * @brief move the grads of `keys` out of `param_cache` and merge them
+   * into the combined grads, push them if the interval is reached
+   *
+   * the grads of `param_cache` are reset, as they would be by a push
+   */
+  template <class Cache>
+  void deposit(const std::unordered_set<key_t> &keys, Cache &param_cache) {
+    bool to_flush = false;
+    {
+      auto &combined = _combined.grads();
+      std::lock_guard<std::mutex> lk(_mut);
+      for (const auto &key : keys) {
+        grad_t *grad = param_cache.find_grad(key);
+        if (grad == nullptr)
+          continue;
+        combined[key].merge(*grad);
+        grad->reset();
+        _keys.insert(key);
+      }
+      if (_interval > 0 && ++_num_deposits >= _interval) {
+        _num_deposits = 0;
+        to_flush = true;
+      }
+    }
+    if (to_flush)
+      flush();
+  }
+  /**
+   * @brief push all the combined grads and wait for the servers
+   *
+   * should be called once the training threads finish, to push the grads
+   * deposited after the last interval.
+   *
+   * @param residuals push the residuals held by a sparse push as well
+   */
+  void flush(bool residuals = false) {
+    // one push at a time, deposits go on while it is sent
+    std::lock_guard<std::mutex> flush_lk(_flush_mut);
+    param_cache_t sending;
+    std::unordered_set<key_t> keys;
+    {
+      std::lock_guard<std::mutex> lk(_mut);
+      auto &combined = _combined.grads();
+      auto &grads = sending.grads();
+      for (const auto &key : _keys) {
+        auto it = combined.find(key);
+        grads[key] = it->second;
+        it->second.reset();
+      }
+      keys.swap(_keys);
+    }
+    if (keys.empty())
+      return;
+    _push_access.push_with_barrier(keys, sending, residuals);
+    // merge back the residuals held by a sparse push
+    if (_push_access.keeps_residual()) {
+      std::lock_guard<std::mutex> lk(_mut);
+      auto &combined = _combined.grads();
+      for (auto &item : sending.grads()) {
+        if (item.second.magnitude() == 0)
+          continue;
+        combined[item.first].merge(item.second);
+        _keys.insert(item.first);
+      }
+    }
+  }
+
+private:
+  int _interval;
+  int _num_deposits = 0;
+  push_access_t &_push_access;
+  // only the grads are used
+  param_cache_t _combined;
+  // keys with grads deposited since the last push
+  std::unordered_set<key_t> _keys;
+  std::mutex _mut;
+  std::mutex _flush_mut;
+}; // end class PushCombiner
+
+}; // end namespace swift_snails
@@ -0,0 +1,159 @@
+#pragma once
+#include "../utils/all.h"
+#include "param.h"
+#include "global_pull_access.h"
+namespace swift_snails {
+/**
+ * @brief parameter cache shared by the training threads of a worker
+ * process, pulls of the threads are deduplicated
+ *
+ * a thread acquires the keys of its minibatch before training and
+ * releases them after its push. A key is pulled only by the first thread
+ * that needs it, threads asking for a key in flight wait for that pull,
+ * and a key held by any thread is served without another pull. Once no
+ * thread holds a key, its row is stale and the next acquire pulls it
+ * again.
+ *
+ * @param Key key
+ * @param Val local parameter type
+ * @param Grad local gradient type
+ * @param ParamCache `LocalParamCache` or `SlotParamCache`
+ */
+template <typename Key, typename Val, typename Grad,
+          typename ParamCache = LocalParamCache<Key, Val, Grad>>
+class SharedPullCache : public VirtualObject {
+public:
+  typedef Key key_t;
+  typedef Val val_t;
+  typedef Grad grad_t;
+  typedef ParamCache param_cache_t;
+  typedef GlobalPullAccess<key_t, val_t, grad_t> pull_access_t;
+
+  /**
+   * @param param_cache cache the values are pulled to, shared by the
+   * threads
+   */
+  explicit SharedPullCache(param_cache_t &param_cache)
+      : _param_cache(param_cache),
+        _pull_access(global_pull_access<key_t, val_t, grad_t>()) {}
+  /**
+   * @brief make sure the values of `keys` are in the cache and hold them
+   * until `release()`
+   */
+  void acquire(const std::unordered_set<key_t> &keys) {
+    StateBarrier barrier;
+    acquire_async(keys, [&barrier] {
+      barrier.set_state_valid();
+      barrier.try_unblock();
+    });
+    barrier.block();
+  }
+  /**
+   * @brief hold `keys` without waiting, `ready` is called once their
+   * values are in the cache
+   *
+   * `ready` is run by a response thread, or by the calling thread if no
+   * key is in flight, so it should not block.
+   */
+  void acquire_async(const std::unordered_set<key_t> &keys, voidf_t ready) {
+    // one count per key in flight, and one for the loop below
+    auto waiter = std::make_shared<Waiter>();
+    waiter->ready = std::move(ready);
+    waiter->rest = 1;
+    std::unordered_set<key_t> to_pull;
+    {
+      std::lock_guard<std::mutex> lk(_mut);
+      for (const auto &key : keys) {
+        Entry &entry = _entries[key];
+        if (entry.refs++ == 0) {
+          entry.ready = false;
+          to_pull.insert(key);
+        }
+        if (entry.ready)
+          continue;
+        waiter->rest++;
+        entry.waiters.push_back(waiter);
+      }
+    }
+    _num_requested += keys.size();
+    _num_pulled += to_pull.size();
+    if (!to_pull.empty()) {
+      auto pulled =
+          std::make_shared<std::unordered_set<key_t>>(std::move(to_pull));
+      _pull_access.pull_async(*pulled, _param_cache,
+                              [this, pulled] { set_ready(*pulled); });
+    }
+    if (--waiter->rest == 0)
+      waiter->ready();
+  }
+  /**
+   * @brief drop the hold of a thread on `keys`
+   */
+  void release(const std::unordered_set<key_t> &keys) {
+    std::lock_guard<std::mutex> lk(_mut);
+    for (const auto &key : keys) {
+      auto it = _entries.find(key);
+      CHECK(it != _entries.end()) << "release a key not acquired";
+      CHECK_GT(it->second.refs, 0);
+      if (--it->second.refs == 0)
+        _entries.erase(it);
+    }
+  }
+  /**
+   * @brief ratio of acquired keys that were pulled since the last call
+   * of `reset_stat()`
+   */
+  float pull_ratio() const {
+    size_t num_requested = _num_requested;
+    if (num_requested == 0)
+      return 0;
+    return float(_num_pulled) / num_requested;
+  }
+  void reset_stat() {
+    _num_requested = 0;
+    _num_pulled = 0;
+  }
+  param_cache_t &param_cache() { return _param_cache; }
+
+private:
+  struct Waiter {
+    // keys the holder still waits for
+    std::atomic<size_t> rest{0};
+    voidf_t ready;
+  };
+  struct Entry {
+    // number of threads holding the key
+    int refs = 0;
+    // false while the key is in flight
+    bool ready = false;
+    // holders waiting for the key in flight
+    std::vector<std::shared_ptr<Waiter>> waiters;
+  };
+  // the pull of `keys` is finished
+  void set_ready(const std::unordered_set<key_t> &keys) {
+    std::vector<std::shared_ptr<Waiter>> waiters;
+    {
+      std::lock_guard<std::mutex> lk(_mut);
+      for (const auto &key : keys) {
+        Entry &entry = _entries[key];
+        entry.ready = true;
+        for (auto &waiter : entry.waiters)
+          waiters.push_back(std::move(waiter));
+        entry.waiters.clear();
+      }
+    }
+    for (auto &waiter : waiters) {
+      if (--waiter->rest == 0)
+        waiter->ready();
+    }
+  }
+
+  param_cache_t &_param_cache;
+  pull_access_t &_pull_access;
+  std::unordered_map<key_t, Entry> _entries;
+  std::mutex _mut;
+  std::atomic<size_t> _num_requested{0};
+  std::atomic<size_t> _num_pulled{0};
+}; // end class SharedPullCache
+
+}; // end namespace swift_snails
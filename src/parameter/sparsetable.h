@@ -23,6 +23,7 @@ public:
 
   SparseTableShard() {
     data().set_empty_key(std::numeric_limits<key_t>::max());
+    data().set_deleted_key(std::numeric_limits<key_t>::max() - 1);
   }
 
   bool find(const key_t &key, value_t *&val) {
@@ -51,6 +52,24 @@ public:
     rwlock_read_guard lock(_rwlock);
     return data().size();
   }
+  /**
+   * @brief call `handler(key, value)` on every row
+   */
+  template <typename Handler> void for_each(Handler handler) {
+    rwlock_read_guard lock(_rwlock);
+    for (auto &item : data())
+      handler(item.first, item.second);
+  }
+  /**
+   * @brief drop the rows whose key passes `filter`
+   */
+  template <typename Filter> void erase_if(Filter filter) {
+    rwlock_write_guard lock(_rwlock);
+    for (auto it = data().begin(); it != data().end(); ++it) {
+      if (filter(it->first))
+        data().erase(it);
+    }
+  }
   void set_shard_id(int x) {
     CHECK_GE(x, 0);
     _shard_id = x;
@@ -130,6 +149,20 @@ public:
       file << shard(i);
     }
   }
+  /**
+   * @brief call `handler(key, value)` on every row
+   */
+  template <typename Handler> void for_each(Handler handler) {
+    for (int i = 0; i < shard_num(); i++)
+      shard(i).for_each(handler);
+  }
+  /**
+   * @brief drop the rows whose key passes `filter`
+   */
+  template <typename Filter> void erase_if(Filter filter) {
+    for (int i = 0; i < shard_num(); i++)
+      shard(i).erase_if(filter);
+  }
 
   index_t size() const {
     index_t res = 0;
@@ -140,12 +173,33 @@ public:
     return res;
   }
   // TODO assign protected
-  int to_shard_id(const key_t &key) { return get_hash_code(key) % shard_num(); }
+  /*
+   * the hash is seeded apart from the one of hashfrag, or the keys of a
+   * fragment would crowd into a few shards
+   */
+  int to_shard_id(const key_t &key) {
+    return get_hash_code(key, shard_hash_seed) % shard_num();
+  }
   int shard_num() const { return _shard_num; }
+  /**
+   * @brief size of the largest shard over the mean size
+   */
+  float shard_skew() const {
+    index_t total = 0, largest = 0;
+    for (int i = 0; i < shard_num(); i++) {
+      index_t size = _shards[i].size();
+      total += size;
+      largest = std::max(largest, size);
+    }
+    if (total == 0)
+      return 1;
+    return float(largest) * shard_num() / total;
+  }
 
 private:
   std::unique_ptr<shard_t[]> _shards;
   int _shard_num = 1;
+  static const uint64_t shard_hash_seed = 1;
 }; // class SparseTable
 
 }; // end namespace swift_snails
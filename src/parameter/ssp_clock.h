@@ -0,0 +1,92 @@
+#pragma once
+#include "../utils/all.h"
+#include "../transfer/transfer.h"
+#include "../cluster/message_classes.h"
+#include "../cluster/worker.h"
+namespace swift_snails {
+/**
+ * @brief clock of a worker in the stale synchronous mode
+ *
+ * the clock is the number of minibatches the slowest training thread of
+ * the worker finished. It is sent to every server when it moves, and a
+ * server holds the pulls of a worker more than `ssp_staleness` clocks
+ * ahead of the slowest worker. `ssp_staleness` 0 is bulk synchronous,
+ * -1 disables the mode.
+ */
+class SSPClock : public VirtualObject {
+public:
+  explicit SSPClock(int num_threads = 1)
+      : _clocks(num_threads, 0),
+        _staleness(
+            global_config().get("cluster", "ssp_staleness", "-1").to_int32()),
+        gtransfer(global_worker().transfer()) {
+    CHECK_GT(num_threads, 0);
+  }
+
+  bool enabled() const { return _staleness >= 0; }
+  /**
+   * @brief a thread finished a minibatch, should be called before the
+   * pull of the next one
+   */
+  void tick(int thread_id = 0) { set(thread_id, -1); }
+  /**
+   * @brief a thread finished training, others are not held by it
+   */
+  void finish(int thread_id = 0) {
+    set(thread_id, std::numeric_limits<int>::max());
+  }
+  void finish_all() {
+    for (size_t i = 0; i < _clocks.size(); i++)
+      finish(i);
+  }
+
+protected:
+  // move the clock of a thread, to the next one if `clock` < 0
+  void set(int thread_id, int clock) {
+    if (!enabled())
+      return;
+    int min_clock;
+    {
+      std::lock_guard<std::mutex> lk(_mut);
+      int &cur = _clocks.at(thread_id);
+      cur = clock < 0 ? cur + 1 : clock;
+      min_clock = *std::min_element(_clocks.begin(), _clocks.end());
+      if (min_clock <= _reported)
+        return;
+      _reported = min_clock;
+    }
+    report(min_clock);
+  }
+  /**
+   * the servers have the clock before the next pull is sent
+   */
+  void report(int clock) {
+    const auto &server_ids = global_route().server_ids();
+    if (server_ids.empty())
+      return;
+    StateBarrier barrier;
+    std::atomic<size_t> num_reqs{server_ids.size()};
+    for (int node_id : server_ids) {
+      Request req;
+      req.meta.message_class = WORKER_CLOCK;
+      req.cont << clock;
+      req.call_back_handler = [&barrier, &num_reqs](std::shared_ptr<Request>) {
+        if (--num_reqs == 0) {
+          barrier.set_state_valid();
+          barrier.try_unblock();
+        }
+      };
+      gtransfer.send(std::move(req), node_id);
+    }
+    barrier.block();
+  }
+
+private:
+  std::vector<int> _clocks;
+  int _reported = 0;
+  int _staleness;
+  std::mutex _mut;
+  Transfer<ServerWorkerRoute> &gtransfer;
+}; // end class SSPClock
+
+}; // end namespace swift_snails
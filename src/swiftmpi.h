@@ -7,3 +7,13 @@
 #include "parameter/param.h"
 #include "parameter/global_pull_access.h"
 #include "parameter/global_push_access.h"
+#include "parameter/push_combiner.h"
+#include "parameter/shared_pull_cache.h"
+#include "parameter/host_aggregator.h"
+#include "parameter/ssp_clock.h"
+#include "parameter/param_prefetcher.h"
+#include "parameter/persistent_cache.h"
+#include "parameter/grad_buffer.h"
+#include "parameter/local_sgd.h"
+#include "parameter/minibatch_tuner.h"
+#include "cluster/chunk_queue.h"
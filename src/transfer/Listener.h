@@ -8,57 +8,92 @@
 #ifndef Swift_transfer_Listener_h_
 #define Swift_transfer_Listener_h_
 #include "../utils/all.h"
+#include "Route.h"
+#include "Transport.h"
 namespace swift_snails {
 
-class Listener : VirtualObject {
+/**
+ * \brief ZMQ transport
+ *
+ * messages are sent through the route's ZMQ_PUSH sockets.
+ * every service thread owns a ZMQ_PULL socket bound to its own port,
+ * so the threads receive in parallel without sharing a socket.
+ * A node's sender connects to all the ports and ZMQ spreads the
+ * messages over them.
+ */
+class Listener : public Transport {
 public:
-  explicit Listener() {}
-  void set_zmq_ctx(void *zmq) {
-    _zmq_ctx = zmq;
-    PCHECK(_receiver = zmq_socket(_zmq_ctx, ZMQ_PULL));
-  }
-
-  explicit Listener(void *zmq_ctx) : _zmq_ctx(zmq_ctx) {
-    PCHECK(_receiver = zmq_socket(_zmq_ctx, ZMQ_PULL));
+  explicit Listener(BaseRoute &route) : _route(route) {
+    PCHECK(_zmq_ctx = zmq_ctx_new());
   }
 
   ~Listener() {
     LOG(WARNING) << "listener exit!";
-    if (_receiver) {
-      PCHECK(0 == zmq_close(_receiver));
-      _receiver = NULL;
+    for (void *receiver : _receivers) {
+      PCHECK(0 == zmq_close(receiver));
     }
+    _receivers.clear();
+    PCHECK(0 == zmq_ctx_destroy(_zmq_ctx));
   }
 
-  virtual void main_loop() = 0;
-  virtual bool service_complete() = 0;
-
+  /**
+   * \warning should be called before `listen()`
+   */
   void set_thread_num(int num) {
     CHECK(num > 0);
+    CHECK(_receivers.empty()) << "thread num should be set before listen";
     _thread_num = num;
   }
   int thread_num() const { return _thread_num; }
+  /**
+   * \brief number of ZMQ I/O threads of the receive context
+   * \warning should be called before `listen()`
+   */
+  void set_io_threads(int num) {
+    CHECK_GT(num, 0);
+    CHECK(_receivers.empty()) << "io threads should be set before listen";
+    PCHECK(0 == zmq_ctx_set(_zmq_ctx, ZMQ_IO_THREADS, num));
+  }
+  /**
+   * \brief ZMQ_RCVHWM and ZMQ_RCVBUF of each receiver socket
+   *
+   * 0 keeps the ZMQ default
+   */
+  void set_recv_options(int hwm, int buffer_size) {
+    CHECK_GE(hwm, 0);
+    CHECK_GE(buffer_size, 0);
+    _recv_hwm = hwm;
+    _recv_buffer = buffer_size;
+  }
+
+  virtual void send(Request &request, int to_id) {
+    // convert Request to underlying Package
+    Package package(request);
+    // send the package through the thread's own socket
+    void *sender = _route.sender(to_id);
+    PCHECK(ignore_signal_call(zmq_msg_send, &package.meta.zmg(), sender,
+                              ZMQ_SNDMORE) >= 0);
+    PCHECK(ignore_signal_call(zmq_msg_send, &package.cont.zmg(), sender, 0) >=
+           0);
+  }
 
-  void service_start() {
+  virtual void service_start() {
     LOG(WARNING) << "ListenService start " << thread_num() << " threads";
     CHECK(_thread_num > 0);
+    CHECK_EQ((int)_receivers.size(), thread_num()) << "should listen first";
     _threads.resize(thread_num());
     for (int i = 0; i < thread_num(); i++) {
-      _threads[i] = std::thread([this]() { main_loop(); });
+      void *receiver = _receivers[i];
+      _threads[i] = std::thread([this, receiver]() { main_loop(receiver); });
     }
   }
 
-  void service_end() {
+  virtual void service_end() {
     LOG(WARNING) << "SenderService service threads exit!";
     CHECK(!_threads.empty());
-
-    {
-      std::lock_guard<SpinLock> lock(_spinlock);
-      CHECK(service_complete());
-    }
-    // tell all service threads to exit
+    // tell all service threads to exit, one message to each socket
     for (int i = 0; i < thread_num(); i++) {
-      zmq_send_push_once(zmq_ctx(), &Message().zmg(), recv_addr());
+      zmq_send_push_once(zmq_ctx(), &Message().zmg(), recv_addrs()[i]);
     }
 
     for (int i = 0; i < thread_num(); i++) {
@@ -73,46 +108,106 @@ public:
   }
 
   /*
-   * listen to a random port
+   * listen to random ports, one for each service thread
+   *
+   * return the first port
    */
   int listen() {
     if (_recv_ip.empty()) {
       _recv_ip = get_local_ip();
     }
-    CHECK(_recv_port == -1) << "local receiver can only listen once";
-    zmq_bind_random_port(_recv_ip, _receiver, _recv_addr, _recv_port);
-    LOG(INFO) << "client listen to address:\t" << _recv_addr;
-    return _recv_port;
+    CHECK(_recv_ports.empty()) << "local receiver can only listen once";
+    for (int i = 0; i < thread_num(); i++) {
+      void *receiver = new_receiver();
+      std::string addr;
+      int port;
+      zmq_bind_random_port(_recv_ip, receiver, addr, port);
+      LOG(INFO) << "client listen to address:\t" << addr;
+      _recv_addrs.push_back(std::move(addr));
+      _recv_ports.push_back(port);
+    }
+    return recv_port();
   }
   /*
-   * listen to a specified address
+   * listen to a specified address like tcp://ip:port
+   *
+   * the i-th service thread listens to port + i
    */
   void listen(const std::string &addr) {
     LOG(INFO) << "server listen to " << addr;
-    _recv_addr = addr;
-    int res;
-    PCHECK((res = zmq_bind(_receiver, addr.c_str()), res == 0));
+    CHECK(_recv_ports.empty()) << "local receiver can only listen once";
+    size_t pos = addr.rfind(':');
+    CHECK(pos != std::string::npos && headswith(addr, "tcp://"))
+        << "listen_addr should be like tcp://ip:port";
+    _recv_ip = addr.substr(6, pos - 6);
+    int port = std::stoi(addr.substr(pos + 1));
+    for (int i = 0; i < thread_num(); i++) {
+      void *receiver = new_receiver();
+      std::string addr_;
+      format_string(addr_, "tcp://%s:%d", _recv_ip.c_str(), port + i);
+      int res;
+      PCHECK((res = zmq_bind(receiver, addr_.c_str()), res == 0));
+      _recv_addrs.push_back(std::move(addr_));
+      _recv_ports.push_back(port + i);
+    }
   }
 
   void *zmq_ctx() { return _zmq_ctx; }
   // get attributes
-  void *receiver() { return _receiver; }
-  std::mutex &receiver_mutex() { return _receiver_mutex; }
-  const std::string &recv_addr() const { return _recv_addr; }
+  const std::vector<std::string> &recv_addrs() const { return _recv_addrs; }
+  virtual const std::vector<int> &recv_ports() const { return _recv_ports; }
+  const std::string &recv_addr() const { return _recv_addrs.front(); }
   const std::string &recv_ip() const { return _recv_ip; }
-  int recv_port() const { return _recv_port; }
+  int recv_port() const { return _recv_ports.empty() ? -1 : _recv_ports[0]; }
+
+protected:
+  /**
+   * \brief receive messages from a socket owned by the calling thread
+   * and deliver them
+   *
+   * an empty message tells the thread to exit
+   */
+  void main_loop(void *receiver) {
+    Package package;
+    for (;;) {
+      PCHECK(ignore_signal_call(zmq_msg_recv, &package.meta.zmg(), receiver,
+                                0) >= 0);
+      if (package.meta.size() == 0)
+        break;
+      CHECK(zmq_msg_more(&package.meta.zmg()));
+      PCHECK(ignore_signal_call(zmq_msg_recv, &package.cont.zmg(), receiver,
+                                0) >= 0);
+      CHECK(!zmq_msg_more(&package.cont.zmg()));
+      deliver(std::make_shared<Request>(std::move(package)));
+    }
+    LOG(WARNING) << "sender terminated!";
+  }
+
+  void *new_receiver() {
+    void *receiver = nullptr;
+    PCHECK(receiver = zmq_socket(_zmq_ctx, ZMQ_PULL));
+    if (_recv_hwm > 0)
+      PCHECK(0 == zmq_setsockopt(receiver, ZMQ_RCVHWM, &_recv_hwm,
+                                 sizeof(_recv_hwm)));
+    if (_recv_buffer > 0)
+      PCHECK(0 == zmq_setsockopt(receiver, ZMQ_RCVBUF, &_recv_buffer,
+                                 sizeof(_recv_buffer)));
+    _receivers.push_back(receiver);
+    return receiver;
+  }
 
 protected:
+  BaseRoute &_route;
   void *_zmq_ctx = NULL;
-  void *_receiver = NULL;
-  std::mutex _receiver_mutex;
-  std::string _recv_addr;
+  std::vector<void *> _receivers;
+  std::vector<std::string> _recv_addrs;
+  std::vector<int> _recv_ports;
   std::string _recv_ip;
-  int _recv_port = -1;
   int _thread_num = -1;
+  int _recv_hwm = 0;
+  int _recv_buffer = 0;
   // listen service
   std::vector<std::thread> _threads;
-  SpinLock _spinlock;
 
 }; // end Listener
 
@@ -0,0 +1,184 @@
+//
+//  MPITransport.h
+//  SwiftSnails
+//
+#ifndef SwiftSnails_transfer_MPITransport_h_
+#define SwiftSnails_transfer_MPITransport_h_
+#include "../utils/all.h"
+#include "Route.h"
+#include "Transport.h"
+namespace swift_snails {
+
+/**
+ * \brief MPI point-to-point transport
+ *
+ * A message is sent with `MPI_Isend` as a single byte array: the meta
+ * followed by the content. Its destination is the rank of the node, and
+ * its tag is the node's role, so the worker and the server of one rank
+ * receive apart on the MPI communicator reserved for it.
+ *
+ * One progress thread receives with `MPI_Improbe` and `MPI_Mrecv`. It
+ * also completes the pending sends and frees their buffers.
+ *
+ * \warning needs MPI_THREAD_MULTIPLE
+ */
+class MPITransport : public Transport {
+public:
+  /**
+   * \param role the route role of the owner's node, messages for nodes of
+   * this role in the local process are received here
+   */
+  MPITransport(BaseRoute &route, int role)
+      : _route(route), _comm(global_mpi().p2p_comm()), _tag(role) {
+    CHECK(global_mpi().thread_multiple())
+        << "MPI transport needs MPI_THREAD_MULTIPLE support";
+  }
+
+  ~MPITransport() { CHECK(!_thread.joinable()) << "service should end first"; }
+
+  virtual void send(Request &request, int to_id) {
+    const size_t size = meta_size + request.cont.size();
+    CHECK_LE(size, (size_t)std::numeric_limits<int>::max());
+    PendingSend pending;
+    pending.buffer.reset(new char[size]);
+    write_meta(request.meta, pending.buffer.get());
+    if (request.cont.size() > 0)
+      memcpy(pending.buffer.get() + meta_size, request.cont.buffer(),
+             request.cont.size());
+    CHECK(0 == MPI_Isend(pending.buffer.get(), (int)size, MPI_BYTE,
+                         _route.node_rank(to_id), _route.node_role(to_id),
+                         _comm, &pending.request));
+    std::lock_guard<std::mutex> lock(_pending_mut);
+    _pending.push_back(std::move(pending));
+  }
+
+  virtual void service_start() {
+    LOG(WARNING) << "MPI transport start, tag " << _tag;
+    CHECK(!_thread.joinable()) << "service has started";
+    _stop = false;
+    _thread = std::thread([this] { main_loop(); });
+  }
+  /**
+   * the pending sends are completed before the progress thread exits
+   */
+  virtual void service_end() {
+    LOG(WARNING) << "MPI transport exit!";
+    CHECK(_thread.joinable());
+    _stop = true;
+    _thread.join();
+  }
+  // MPI needs no address exchange
+  virtual const std::vector<int> &recv_ports() const { return _no_ports; }
+
+protected:
+  struct PendingSend {
+    MPI_Request request;
+    std::unique_ptr<char[]> buffer;
+  };
+
+  void main_loop() {
+    std::vector<PendingSend> sending;
+    int idle = 0;
+    for (;;) {
+      bool busy = receive_one();
+      busy = test_sends(sending) || busy;
+      if (busy) {
+        idle = 0;
+        continue;
+      }
+      if (_stop && sending.empty()) {
+        std::lock_guard<std::mutex> lock(_pending_mut);
+        if (_pending.empty())
+          break;
+      }
+      // back off when idle for long to keep the core free
+      if (++idle < _spin_rounds) {
+        std::this_thread::yield();
+      } else {
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+      }
+    }
+  }
+  /**
+   * receive and deliver one message if any
+   */
+  bool receive_one() {
+    int flag = 0;
+    MPI_Message message;
+    MPI_Status status;
+    CHECK(0 == MPI_Improbe(MPI_ANY_SOURCE, _tag, _comm, &flag, &message,
+                           &status));
+    if (!flag)
+      return false;
+    int count = 0;
+    CHECK(0 == MPI_Get_count(&status, MPI_BYTE, &count));
+    CHECK_GE(count, (int)meta_size);
+    std::unique_ptr<char[]> buffer(new char[count]);
+    CHECK(0 == MPI_Mrecv(buffer.get(), count, MPI_BYTE, &message,
+                         MPI_STATUS_IGNORE));
+    std::shared_ptr<Request> request = std::make_shared<Request>();
+    read_meta(buffer.get(), request->meta);
+    if (count > (int)meta_size)
+      request->cont.set(buffer.get() + meta_size, count - meta_size);
+    deliver(std::move(request));
+    return true;
+  }
+  /**
+   * test the pending sends and free the finished ones
+   */
+  bool test_sends(std::vector<PendingSend> &sending) {
+    {
+      std::lock_guard<std::mutex> lock(_pending_mut);
+      for (auto &pending : _pending)
+        sending.push_back(std::move(pending));
+      _pending.clear();
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < sending.size(); i++) {
+      int done = 0;
+      CHECK(0 == MPI_Test(&sending[i].request, &done, MPI_STATUS_IGNORE));
+      if (!done) {
+        if (kept != i)
+          sending[kept] = std::move(sending[i]);
+        kept++;
+      }
+    }
+    bool finished_any = kept < sending.size();
+    sending.resize(kept);
+    return finished_any;
+  }
+  /**
+   * the fields of the meta are copied one by one, it is not trivially
+   * copyable
+   */
+  static void write_meta(const MetaMessage &meta, char *buffer) {
+    int fields[num_meta_fields] = {meta.message_class, meta.client_id,
+                                   meta.message_id};
+    memcpy(buffer, fields, meta_size);
+  }
+  static void read_meta(const char *buffer, MetaMessage &meta) {
+    int fields[num_meta_fields];
+    memcpy(fields, buffer, meta_size);
+    meta.message_class = fields[0];
+    meta.client_id = fields[1];
+    meta.message_id = fields[2];
+  }
+
+private:
+  // message class, client id and message id
+  static const int num_meta_fields = 3;
+  static const size_t meta_size = num_meta_fields * sizeof(int);
+  BaseRoute &_route;
+  MPI_Comm _comm;
+  int _tag;
+  std::thread _thread;
+  std::atomic<bool> _stop{false};
+  // sends not yet seen by the progress thread
+  std::vector<PendingSend> _pending;
+  std::mutex _pending_mut;
+  std::vector<int> _no_ports;
+  const int _spin_rounds = 1000;
+}; // end class MPITransport
+
+}; // end namespace swift_snails
+#endif
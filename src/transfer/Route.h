@@ -12,93 +12,187 @@ namespace swift_snails {
 
 /**
  * a controller of routes
+ *
+ * Every thread sends through its own ZMQ_PUSH sockets, one per destination,
+ * created and connected the first time the thread sends to that node. The
+ * sockets are found through a flat array indexed by `node_index(id)`, so
+ * sending takes no lock once a thread has talked to a node. A thread
+ * closes its sockets when it exits.
  */
 class BaseRoute : public VirtualObject {
 
 public:
-  explicit BaseRoute() { _zmq_ctx = zmq_ctx_new(); }
+  explicit BaseRoute()
+      : _registry(std::make_shared<SenderRegistry>()), _serial(next_serial()) {
+    _zmq_ctx = zmq_ctx_new();
+  }
 
   // update the route
   virtual void update() = 0;
+  /**
+   * \brief map a node id to a dense index of the sender array
+   * should be small and unique for every node of the route
+   */
+  virtual size_t node_index(int id) const = 0;
+  /**
+   * \brief kind of service of a node, nodes living in the same process
+   * are told apart by it
+   */
+  virtual int node_role(int id) const = 0;
 
   void *zmq_ctx() { return _zmq_ctx; }
   /**
    * **TODO** change node at once
    * \warning: not thread-safe
+   *
+   * \param rank MPI rank of the process the node lives in
+   * \param addrs addresses of all the receivers of the node, messages
+   * will be spread over them, empty if the transport needs none
    */
-  void register_node(int id, std::string &&addr) {
+  void register_node(int id, int rank, std::vector<std::string> &&addrs) {
     // std::lock_guard<std::mutex> lock(_write_mut);
     CHECK(_send_addrs.count(id) == 0) << "id exists!";
-    _send_addrs.emplace(id, std::move(addr));
-    _send_mutexes.emplace(id, std::unique_ptr<std::mutex>(new std::mutex));
-    void *sender = zmq_socket(_zmq_ctx, ZMQ_PUSH);
-    _senders.emplace(id, sender);
-    connect(id);
+    _send_addrs.emplace(id, std::move(addrs));
+    size_t idx = node_index(id);
+    if (idx >= _ranks.size())
+      _ranks.resize(idx + 1, -1);
+    _ranks[idx] = rank;
   }
 
   /** \warning not thread-safe
    * should use rwlock(Read-Write lock)
+   *
+   * every thread closes its cached senders lazily
    */
   void delete_node(int id) {
     // std::lock_guard<std::mutex> lock(_write_mut);
-    LOG(WARNING) << "delete node " << id << " " << _send_addrs[id];
-    // write lock
-    {
-      auto it = _send_addrs.find(id);
-      CHECK(it != _send_addrs.end());
-      _send_addrs.erase(it);
-    }
-    {
-      auto it = _send_mutexes.find(id);
-      CHECK(it != _send_mutexes.end());
-      _send_mutexes.erase(it);
-    }
-    // drop the connection
-    {
-      auto it = _senders.find(id);
-      CHECK(it != _senders.end());
-      PCHECK(0 == zmq_close(it->second));
-      _senders.erase(it);
+    LOG(WARNING) << "delete node " << id;
+    auto it = _send_addrs.find(id);
+    CHECK(it != _send_addrs.end());
+    _send_addrs.erase(it);
+    _ranks[node_index(id)] = -1;
+    _serial = next_serial();
+  }
+  /**
+   * \brief the calling thread's sender socket of node `id`
+   */
+  void *sender(int id) {
+    LocalSenders &local = local_senders();
+    if (local.serial != _serial) {
+      local.release();
+      local.serial = _serial;
+      local.registry = _registry;
     }
+    size_t idx = node_index(id);
+    if (idx >= local.senders.size())
+      local.senders.resize(idx + 1, nullptr);
+    void *&sender = local.senders[idx];
+    if (!sender)
+      sender = new_sender(id);
+    return sender;
   }
 
-  void *sender(int id) {
+  int node_rank(int id) {
     rwlock_read_guard lock(_read_write_lock);
-    return _senders[id];
+    size_t idx = node_index(id);
+    CHECK(idx < _ranks.size() && _ranks[idx] >= 0) << "no node_id " << id
+                                                   << " in the route";
+    return _ranks[idx];
   }
 
-  const std::string &sender_addr(int id) {
+  bool has_node(int id) {
     rwlock_read_guard lock(_read_write_lock);
-    return _send_addrs[id];
+    return _send_addrs.count(id) > 0;
   }
 
-  std::unique_ptr<std::mutex> &send_mutex(int id) {
+  const std::vector<std::string> &sender_addrs(int id) {
     rwlock_read_guard lock(_read_write_lock);
-    return _send_mutexes[id];
+    return _send_addrs[id];
   }
 
   virtual ~BaseRoute() {
     LOG(WARNING) << "Route deconstruct";
-    for (auto &sender : _senders) {
-      PCHECK(0 == zmq_close(sender.second));
+    {
+      // senders of the threads still alive
+      std::lock_guard<std::mutex> lock(_registry->mut);
+      for (void *sender : _registry->senders) {
+        PCHECK(0 == zmq_close(sender));
+      }
+      _registry->senders.clear();
     }
     PCHECK(0 == zmq_ctx_destroy(_zmq_ctx));
   }
 
-  std::map<int, std::string> &send_addrs() { return _send_addrs; }
+  std::map<int, std::vector<std::string>> &send_addrs() { return _send_addrs; }
 
 protected:
-  void connect(index_t id) {
-    LOG(INFO) << "client connect " << _send_addrs[id];
-    PCHECK(0 == ignore_signal_call(zmq_connect, _senders[id],
-                                   _send_addrs[id].c_str()));
+  /**
+   * senders not closed yet, shared with the threads so that a thread
+   * exiting after the route closes nothing twice
+   */
+  struct SenderRegistry {
+    std::mutex mut;
+    std::unordered_set<void *> senders;
+  };
+  struct LocalSenders {
+    uint64_t serial = 0;
+    std::vector<void *> senders;
+    std::shared_ptr<SenderRegistry> registry;
+
+    ~LocalSenders() { release(); }
+    // close the senders of the thread the route has not closed
+    void release() {
+      if (registry) {
+        std::lock_guard<std::mutex> lock(registry->mut);
+        for (void *sender : senders) {
+          if (sender && registry->senders.erase(sender))
+            PCHECK(0 == zmq_close(sender));
+        }
+      }
+      senders.clear();
+    }
+  };
+  // only one route lives in a process, the serial tells a thread
+  // its cached senders are out of date
+  static LocalSenders &local_senders() {
+    static thread_local LocalSenders local;
+    return local;
+  }
+  static uint64_t next_serial() {
+    static std::atomic<uint64_t> serial{0};
+    return ++serial;
+  }
+  /**
+   * create a socket connected to all the receivers of the node
+   * the socket is closed when the thread exits, or with the route
+   */
+  void *new_sender(int id) {
+    void *sender = zmq_socket(_zmq_ctx, ZMQ_PUSH);
+    CHECK(sender != NULL);
+    {
+      rwlock_read_guard lock(_read_write_lock);
+      auto it = _send_addrs.find(id);
+      CHECK(it != _send_addrs.end()) << "no node_id " << id
+                                     << " in the route";
+      CHECK(!it->second.empty()) << "node " << id << " has no address";
+      for (const auto &addr : it->second) {
+        DLOG(INFO) << "client connect " << addr;
+        PCHECK(0 == ignore_signal_call(zmq_connect, sender, addr.c_str()));
+      }
+    }
+    std::lock_guard<std::mutex> lock(_registry->mut);
+    _registry->senders.insert(sender);
+    return sender;
   }
 
 protected:
   void *_zmq_ctx = NULL;
-  std::map<int, void *> _senders;
-  std::map<int, std::string> _send_addrs;
-  std::map<int, std::unique_ptr<std::mutex>> _send_mutexes;
+  std::map<int, std::vector<std::string>> _send_addrs;
+  // MPI rank of each node, indexed by node_index
+  std::vector<int> _ranks;
+  // sender sockets of the threads
+  std::shared_ptr<SenderRegistry> _registry;
+  std::atomic<uint64_t> _serial;
   // version of the route
   // if _version is out of date, route will
   // be updated
@@ -15,8 +15,10 @@ namespace swift_snails {
  */
 class ServerWorkerRoute : public BaseRoute {
 public:
+  enum { SERVER_ROLE = 0, WORKER_ROLE = 1 };
   // thread-safe
-  int register_node_(bool is_server, std::string &&addr) {
+  int register_node_(bool is_server, int rank,
+                     std::vector<std::string> &&addrs) {
     rwlock_write_guard lock(_read_write_lock);
     int id{-1};
     if (is_server) {
@@ -26,12 +28,26 @@ public:
       id = id_max_range - ++_worker_num;
       _worker_ids.push_back(id);
     }
-    register_node(id, std::move(addr));
+    register_node(id, rank, std::move(addrs));
     CHECK_GE(id, 0);
     return id;
   }
 
   virtual void update() {}
+  /**
+   * servers 1, 2, ... and workers max-1, max-2, ... are interleaved
+   * to 0, 2, ... and 1, 3, ...
+   */
+  virtual size_t node_index(int id) const {
+    CHECK_GT(id, 0) << "invalid node id";
+    if (is_server(id))
+      return 2 * (size_t)(id - 1);
+    return 2 * (size_t)(id_max_range - id) - 1;
+  }
+  virtual int node_role(int id) const {
+    return is_server(id) ? SERVER_ROLE : WORKER_ROLE;
+  }
+  bool is_server(int id) const { return id <= _server_num_max; }
 
   int server_num() const { return _server_num; }
   int worker_num() const { return _worker_num; }
@@ -44,6 +60,7 @@ private:
   std::vector<int> _server_ids;
   std::vector<int> _worker_ids;
   const int id_max_range = std::numeric_limits<int>::max();
+  const int _server_num_max = id_max_range / 2;
 };
 
 inline ServerWorkerRoute &global_route() {
@@ -0,0 +1,58 @@
+//
+//  Transport.h
+//  SwiftSnails
+//
+#ifndef SwiftSnails_transfer_Transport_h_
+#define SwiftSnails_transfer_Transport_h_
+#include "../utils/all.h"
+#include "Message.h"
+namespace swift_snails {
+
+/**
+ * \brief the way messages move between nodes
+ *
+ * A transport sends a `Request` to a node of the route and passes every
+ * message it receives to the deliver handler. `Transfer` works above it
+ * and never touches the underlying library.
+ *
+ * implementations:
+ *
+ * * `Listener`: ZMQ PUSH/PULL sockets over TCP
+ * * `MPITransport`: MPI point-to-point messages
+ */
+class Transport : public VirtualObject {
+public:
+  typedef std::function<void(std::shared_ptr<Request>)> deliver_t;
+
+  /**
+   * \brief handler of every received message
+   * \warning should be set before `service_start()`
+   */
+  void set_deliver(deliver_t &&deliver) { _deliver = std::move(deliver); }
+  /**
+   * \brief send a message to node `to_id`
+   * thread-safe, the request can be destroyed after return
+   */
+  virtual void send(Request &request, int to_id) = 0;
+  // start receiving messages
+  virtual void service_start() = 0;
+  // stop receiving messages and join the receiving threads
+  virtual void service_end() = 0;
+  /**
+   * \brief ports other nodes should connect to
+   * empty if the transport needs no address exchange
+   */
+  virtual const std::vector<int> &recv_ports() const = 0;
+
+protected:
+  void deliver(std::shared_ptr<Request> request) {
+    CHECK(_deliver) << "deliver handler should be set first";
+    _deliver(std::move(request));
+  }
+
+private:
+  deliver_t _deliver;
+}; // end class Transport
+
+}; // end namespace swift_snails
+#endif
@@ -9,7 +9,9 @@
 #define SwiftSnails_transfer_transfer_h_
 #include "../utils/all.h"
 #include "./Message.h"
+#include "Transport.h"
 #include "Listener.h"
+#include "MPITransport.h"
 #include "ServerWorkerRoute.h"
 
 namespace swift_snails {
@@ -61,24 +63,175 @@ private:
   // std::mutex _mut;
 }; // end MessageClass
 
-template <typename Route> class Transfer : public Listener {
+/**
+ * \brief credits of the requests in flight to one node
+ *
+ * a sender takes a credit before sending a request and gives it back
+ * when the response arrives, senders block while the node has too many
+ * requests or bytes in flight
+ */
+class SendCredit {
+public:
+  /**
+   * \param max_messages 0 for no limit
+   * \param max_bytes 0 for no limit
+   */
+  void acquire(size_t bytes, int max_messages, size_t max_bytes) {
+    std::unique_lock<std::mutex> lock(_mut);
+    _cond.wait(lock, [&] {
+      bool messages_ok = max_messages <= 0 || _messages < max_messages;
+      // a request larger than the budget goes when nothing is in flight
+      bool bytes_ok =
+          max_bytes == 0 || _bytes == 0 || _bytes + bytes <= max_bytes;
+      return messages_ok && bytes_ok;
+    });
+    _messages++;
+    _bytes += bytes;
+  }
+  void release(size_t bytes) {
+    {
+      std::lock_guard<std::mutex> lock(_mut);
+      CHECK_GT(_messages, 0);
+      _messages--;
+      _bytes -= bytes;
+    }
+    _cond.notify_all();
+  }
+
+private:
+  std::mutex _mut;
+  std::condition_variable _cond;
+  int _messages = 0;
+  size_t _bytes = 0;
+}; // end class SendCredit
+
+/**
+ * \brief messages with handlers and callbacks
+ *
+ * messages are moved by a `Transport`, the transfer registers the
+ * response callbacks and runs the message-class handlers
+ */
+template <typename Route> class Transfer : public VirtualObject {
 public:
   // message class handler
   typedef std::function<void(std::shared_ptr<Request>, Request &)>
       msgcls_handler_t;
   // message respons callback handler
   typedef Request::response_call_back_t msgrsp_handler_t;
-
-  explicit Transfer() : _route(global_route()) {
-    set_zmq_ctx(_route.zmq_ctx());
-  }
+  /**
+   * \brief lanes of the dispatcher
+   *
+   * each lane can have its own threads, so responses are not queued
+   * behind requests, and cheap pulls are not queued behind heavy pushes.
+   * a lane without threads shares the default async channel.
+   */
+  enum Lane {
+    DEFAULT_LANE = 0,
+    RESPONSE_LANE,
+    PULL_LANE,
+    PUSH_LANE,
+    NUM_LANES
+  };
+
+  explicit Transfer() : _route(global_route()) {}
   // init later
   void init_async_channel(int thread_num) noexcept {
     CHECK(!_async_channel) << "async channel has been created";
     AsynExec as(thread_num);
     _async_channel = as.open();
   }
+  /**
+   * \brief give `lane` its own threads, 0 to share the default channel
+   * \warning should be called before `service_start()`
+   */
+  void init_lane(Lane lane, int thread_num) noexcept {
+    CHECK(lane > DEFAULT_LANE && lane < NUM_LANES);
+    CHECK(!_lanes[lane]) << "lane " << lane << " has been created";
+    if (thread_num <= 0)
+      return;
+    AsynExec as(thread_num);
+    _lanes[lane] = as.open();
+  }
+  /**
+   * \brief requests of `message_class` are run in `lane`
+   * \warning should be called before `service_start()`
+   */
+  void set_lane(index_t message_class, Lane lane) noexcept {
+    CHECK(lane >= DEFAULT_LANE && lane < NUM_LANES);
+    _class_lanes[message_class] = lane;
+  }
   void set_client_id(int client_id) noexcept { _client_id = client_id; }
+  /**
+   * \brief set the transport messages are moved by
+   * \warning should be called before `service_start()`
+   */
+  void set_transport(std::unique_ptr<Transport> &&transport) noexcept {
+    CHECK(!_transport) << "transport has been set";
+    _transport = std::move(transport);
+  }
+  Transport &transport() noexcept { return *_transport; }
+  /**
+   * \brief bound the requests waiting for responses from each node
+   *
+   * \param max_messages max number of requests in flight, 0 for no limit
+   * \param max_bytes max content bytes in flight, 0 for no limit
+   * \warning should be called before sending
+   */
+  void set_flow_control(int max_messages, size_t max_bytes) noexcept {
+    CHECK_GE(max_messages, 0);
+    _max_inflight_messages = max_messages;
+    _max_inflight_bytes = max_bytes;
+  }
+  bool flow_controlled() const noexcept {
+    return _max_inflight_messages > 0 || _max_inflight_bytes > 0;
+  }
+  /**
+   * \brief number of requests received and not yet answered
+   */
+  int pending_requests() const noexcept { return _pending_requests; }
+  // max of pending_requests() ever reached
+  int max_pending_requests() const noexcept { return _max_pending_requests; }
+  const std::vector<int> &recv_ports() const noexcept {
+    return _transport->recv_ports();
+  }
+  /**
+   * \brief start receiving
+   *  receive request and run corresponding message-class-handler
+   *  receive reply message, read the reply message and run the correspondding
+   * handler
+   */
+  void service_start() noexcept {
+    CHECK(_transport) << "transport should be set first";
+    _transport->set_deliver(
+        [this](std::shared_ptr<Request> request) { receive(request); });
+    _transport->service_start();
+  }
+  void service_end() noexcept { _transport->service_end(); }
+  /**
+   * \brief register the transfer of a node in the same process
+   *
+   * messages to `peer_id` are handed to the peer's handlers directly,
+   * skipping ZMQ packaging and the loopback socket
+   */
+  void set_local_peer(int peer_id, Transfer *peer) noexcept {
+    CHECK(peer != this);
+    _local_peer_id = peer_id;
+    _local_peer = peer;
+  }
+  bool is_local_peer(int id) const noexcept {
+    return _local_peer && id == _local_peer_id;
+  }
+  Transfer *local_peer() noexcept { return _local_peer; }
+  /**
+   * \brief run the message-class handler of a request in the calling
+   * thread, the response is left to the caller
+   */
+  void handle_local(std::shared_ptr<Request> request,
+                    Request &response) noexcept {
+    msgcls_handler_t &handler =
+        _message_class.get(request->meta.message_class);
+    handler(request, response);
+  }
   /**
    * \param request request
    * \param to_id  id of the node where the message is sent to
@@ -91,74 +244,47 @@ public:
     if (client_id() >= 0) {
       request.meta.client_id = _client_id;
     }
-    // convert Request to underlying Package
-    Package package(request);
     // LOG(INFO) << "send package";
+    // wait until the node has room for the request
+    PendingResponse pending;
+    pending.to_id = to_id;
+    pending.bytes = request.cont.size();
+    if (flow_controlled()) {
+      credit(to_id).acquire(pending.bytes, _max_inflight_messages,
+                            _max_inflight_bytes);
+    }
+    pending.handler = std::move(request.call_back_handler);
     // cache the recall_back
     // when the sent message's reply is received
     // the call_back handler will be called
     {
       std::lock_guard<SpinLock> lock(_msg_handlers_mut);
       // LOG(INFO) << "to register call_back_handler";
-      CHECK(_msg_handlers.emplace(msg_id, std::move(request.call_back_handler))
-                .second);
+      CHECK(_msg_handlers.emplace(msg_id, std::move(pending)).second);
       // LOG(INFO) << "call_back_handler is registered";
     }
 
-    CHECK(_route.send_addrs().count(to_id) > 0) << "no node_id " << to_id
-                                                << " in the route";
-
-    // send the package
-    Route &route = _route;
-
-    {
-      // LOG(INFO) << "to lock send_mutex";
-      std::lock_guard<std::mutex> lock(*route.send_mutex(to_id));
-      // LOG(INFO) << "zmq to send message";
-      PCHECK(ignore_signal_call(zmq_msg_send, &package.meta.zmg(),
-                                route.sender(to_id), ZMQ_SNDMORE) >= 0);
-      PCHECK(ignore_signal_call(zmq_msg_send, &package.cont.zmg(),
-                                route.sender(to_id), 0) >= 0);
+    if (is_local_peer(to_id)) {
+      std::shared_ptr<Request> local =
+          std::make_shared<Request>(std::move(request));
+      _local_peer->handle_request(local);
+      return;
     }
+    _transport->send(request, to_id);
   }
   /**
-   * \brief start service threads
-   * \warning should run as a thread
-   *  receive request  and run corresponding message-class-handler
-   *  receive reply message, read the reply message and run the correspondding
-   * handler
+   * \brief called by the transport for every received message
    */
-  void main_loop() noexcept {
-    Package package;
-    Request::response_call_back_t handler;
-    for (;;) {
-
-      {
-        std::lock_guard<std::mutex> lock(receiver_mutex());
-        PCHECK(ignore_signal_call(zmq_msg_recv, &package.meta.zmg(), receiver(),
-                                  0) >= 0);
-        if (package.meta.size() == 0)
-          break;
-        CHECK(zmq_msg_more(&package.meta.zmg()));
-        PCHECK(ignore_signal_call(zmq_msg_recv, &package.cont.zmg(), receiver(),
-                                  0) >= 0);
-        CHECK(!zmq_msg_more(&package.cont.zmg()));
-      }
-
-      std::shared_ptr<Request> request =
-          std::make_shared<Request>(std::move(package));
-
-      if (request->is_response()) {
-        RAW_DLOG(INFO, "receive a response, message_id: %d",
-                 request->meta.message_id);
-        handle_response(request);
-      } else {
-        RAW_DLOG(INFO, "receive a request, message_class: %d, client_id: %d",
-                 request->meta.message_class, request->meta.client_id);
-        handle_request(request);
-      }
+  void receive(std::shared_ptr<Request> &request) noexcept {
+    if (request->is_response()) {
+      RAW_DLOG(INFO, "receive a response, message_id: %d",
+               request->meta.message_id);
+      handle_response(request);
+    } else {
+      RAW_DLOG(INFO, "receive a request, message_class: %d, client_id: %d",
+               request->meta.message_class, request->meta.client_id);
+      handle_request(request);
     }
-    LOG(WARNING) << "sender terminated!";
   }
 
   /** handle the request from other node
@@ -167,35 +293,49 @@ public:
   void handle_request(std::shared_ptr<Request> request) noexcept {
 
     msgcls_handler_t handler = _message_class.get(request->meta.message_class);
-    CHECK(!_async_channel->closed());
+    auto &channel = lane_channel(request_lane(request->meta.message_class));
+    CHECK(!channel->closed());
+    // track the depth of the request queue
+    int depth = ++_pending_requests;
+    int max_depth = _max_pending_requests;
+    while (depth > max_depth &&
+           !_max_pending_requests.compare_exchange_weak(max_depth, depth))
+      ;
     // LOG(INFO) << "push task to channel";
-    _async_channel->push([this, handler, request] {
+    channel->push([this, handler, request] {
       Request response;
       handler(request, response);
-      // set response meta
-      response.meta.message_id = request->meta.message_id;
-      response.meta.client_id = request->meta.client_id;
-      // response.meta.message_class = request->meta.message_class;
-      // response flag
-      response.meta.message_class = -1;
-
-      RAW_DLOG(INFO, "send response to client %d", request->meta.client_id);
       // only send response with content
       // empty response will not be sent, and master should
       // send a response with content later
+      // the request stays pending until it is answered
       if (response.cont.size() > 0) {
-        send_response(std::move(response), request->meta.client_id);
+        respond(*request, std::move(response));
       } else {
         RAW_DLOG(INFO, "empty response, not send");
       }
     });
   }
+  /**
+   * \brief send the response of a request
+   * a handler that leaves the response empty can respond later by it
+   */
+  void respond(const Request &request, Request &&response) noexcept {
+    --_pending_requests;
+    // set response meta
+    response.meta.message_id = request.meta.message_id;
+    // response.meta.message_class = request->meta.message_class;
+    // response flag
+    response.meta.message_class = -1;
+    RAW_DLOG(INFO, "send response to client %d", request.meta.client_id);
+    send_response(std::move(response), request.meta.client_id);
+  }
 
   /** handle the response from other node
    * and run response-callback handler
    */
   void handle_response(std::shared_ptr<Request> &response) noexcept {
-    Request::response_call_back_t handler;
+    PendingResponse pending;
     // NOTE: allow client_id == 0 , when the cluster's route has not been
     // created
     CHECK((_client_id >= -1 && _client_id <= 0) ||
@@ -209,35 +349,31 @@ public:
       std::lock_guard<SpinLock> lock(_msg_handlers_mut);
       auto it = _msg_handlers.find(response->message_id());
       CHECK(it != _msg_handlers.end());
-      handler = std::move(it->second);
+      pending = std::move(it->second);
       _msg_handlers.erase(it);
     }
+    // the node can take another request
+    if (flow_controlled())
+      credit(pending.to_id).release(pending.bytes);
+    Request::response_call_back_t handler = std::move(pending.handler);
 
     // LOG(INFO) << ".. push response handler to channel";
 
     // execute the response_recallback handler
-    _async_channel->push(
+    lane_channel(RESPONSE_LANE)->push(
         // TODO refrence handler?
         [handler, this, response]() { handler(response); });
   }
 
   void send_response(Request &&request, int to_id) noexcept {
-    CHECK_GT(global_route().send_addrs().count(to_id), 0) << "to_id(" << to_id
-                                                          << ") is not valid";
     request.meta.client_id = to_id;
-    Package package(request);
-    Route &route = _route;
-    {
-      // TODO will the mutex share between sender and receiver
-      // effect performance?
-      std::lock_guard<std::mutex> lock(*route.send_mutex(to_id));
-      PCHECK(ignore_signal_call(zmq_msg_send, &package.meta.zmg(),
-                                route.sender(to_id), ZMQ_SNDMORE) >= 0);
-      PCHECK(ignore_signal_call(zmq_msg_send, &package.cont.zmg(),
-                                route.sender(to_id), 0) >= 0);
-
-      // LOG(INFO) << "response has been sent";
+    if (is_local_peer(to_id)) {
+      std::shared_ptr<Request> local =
+          std::make_shared<Request>(std::move(request));
+      _local_peer->handle_response(local);
+      return;
     }
+    _transport->send(request, to_id);
   }
 
   int client_id() const noexcept { return _client_id; }
@@ -264,8 +400,6 @@ public:
     service_end();
 
     LOG(WARNING) << "transfer listener exit!";
-    PCHECK(0 == zmq_close(_receiver));
-    _receiver = NULL;
 
     //_async_channel->close();
   }
@@ -275,15 +409,88 @@ private:
 
   std::atomic<index_t> _msg_id_counter{0};
   std::shared_ptr<AsynExec::channel_t> _async_channel;
-  std::map<index_t, Request::response_call_back_t> _msg_handlers;
+  // channels of the lanes with their own threads
+  std::shared_ptr<AsynExec::channel_t> _lanes[NUM_LANES];
+  std::map<index_t, Lane> _class_lanes;
+  Lane request_lane(index_t message_class) const noexcept {
+    auto it = _class_lanes.find(message_class);
+    return it == _class_lanes.end() ? DEFAULT_LANE : it->second;
+  }
+  std::shared_ptr<AsynExec::channel_t> &lane_channel(Lane lane) noexcept {
+    return _lanes[lane] ? _lanes[lane] : _async_channel;
+  }
+
+  struct PendingResponse {
+    Request::response_call_back_t handler;
+    int to_id = -1;
+    size_t bytes = 0;
+  };
+  SendCredit &credit(int to_id) noexcept {
+    std::lock_guard<SpinLock> lock(_credits_mut);
+    auto &credit = _credits[to_id];
+    if (!credit)
+      credit.reset(new SendCredit);
+    return *credit;
+  }
+
+  std::map<index_t, PendingResponse> _msg_handlers;
 
   // SpinLock    _send_mut;
   SpinLock _msg_handlers_mut;
   MessageClass<msgcls_handler_t> _message_class;
+  std::unique_ptr<Transport> _transport;
+  // flow control
+  int _max_inflight_messages = 0;
+  size_t _max_inflight_bytes = 0;
+  std::map<int, std::unique_ptr<SendCredit>> _credits;
+  SpinLock _credits_mut;
+  std::atomic<int> _pending_requests{0};
+  std::atomic<int> _max_pending_requests{0};
 
   int _client_id = -2;
+  // node in the same process, -1 when there is none
+  int _local_peer_id = -1;
+  Transfer *_local_peer = nullptr;
 
 }; // end class Transfer
 
+/**
+ * \brief create the transport of the worker or server `section`
+ *
+ * `[cluster] transport` is `zmq` or `mpi`, the ZMQ options are read
+ * from the section
+ *
+ * \param role route role of the node
+ */
+inline std::unique_ptr<Transport> make_transport(const std::string &section,
+                                                 int role) {
+  std::string kind =
+      global_config().get("cluster", "transport", "zmq").to_string();
+  if (kind == "mpi") {
+    return std::unique_ptr<Transport>(new MPITransport(global_route(), role));
+  }
+  CHECK(kind == "zmq") << "unknown transport " << kind;
+  std::string listen_addr =
+      global_config().get(section, "listen_addr").to_string();
+  int service_thread_num =
+      global_config().get(section, "listen_thread_num").to_int32();
+  int io_threads =
+      global_config().get(section, "zmq_io_threads", "1").to_int32();
+  int recv_hwm = global_config().get(section, "zmq_recv_hwm", "0").to_int32();
+  int recv_buffer =
+      global_config().get(section, "zmq_recv_buffer", "0").to_int32();
+  std::unique_ptr<Listener> listener(new Listener(global_route()));
+  // each service thread listens to its own socket
+  listener->set_thread_num(service_thread_num);
+  listener->set_io_threads(io_threads);
+  listener->set_recv_options(recv_hwm, recv_buffer);
+  if (!listen_addr.empty()) {
+    listener->listen(listen_addr);
+  } else {
+    listener->listen();
+  }
+  return std::unique_ptr<Transport>(std::move(listener));
+}
+
 }; // end namespace swift_snails
 #endif
@@ -0,0 +1,43 @@
+#include <iostream>
+#include "../../cluster/chunk_queue.h"
+#include "gtest/gtest.h"
+using namespace swift_snails;
+
+TEST(ChunkQueue, ranges) {
+  ASSERT_EQ(ChunkQueue::count_chunks(0, 10), 0);
+  ASSERT_EQ(ChunkQueue::count_chunks(10, 10), 1);
+  ASSERT_EQ(ChunkQueue::count_chunks(25, 10), 3);
+  // the ranges cover the file without overlap
+  long long begin, end, last_end = 0;
+  for (int chunk = 0; chunk < 3; chunk++) {
+    ChunkQueue::chunk_range(chunk, 10, 25, begin, end);
+    ASSERT_EQ(begin, last_end);
+    last_end = end;
+  }
+  ASSERT_EQ(last_end, 25);
+  ChunkQueue::chunk_range(2, 10, 25, begin, end);
+  ASSERT_EQ(begin, 20);
+  ASSERT_EQ(end, 25);
+}
+
+TEST(ChunkQueue, seek) {
+  FILE *file = tmpfile();
+  ASSERT_TRUE(file != NULL);
+  // lines start at 0, 6 and 12
+  fputs("hello\nworld\nagain\n", file);
+  char line[16];
+  // a chunk starting at a line keeps it
+  ChunkQueue::seek(file, 0);
+  ASSERT_EQ(ftell(file), 0);
+  ChunkQueue::seek(file, 6);
+  ASSERT_EQ(ftell(file), 6);
+  ASSERT_TRUE(fgets(line, sizeof(line), file) != NULL);
+  ASSERT_STREQ(line, "world\n");
+  // the line cut by the start of a chunk belongs to the chunk before
+  ChunkQueue::seek(file, 8);
+  ASSERT_EQ(ftell(file), 12);
+  ChunkQueue::seek(file, 13);
+  ASSERT_EQ(ftell(file), 18);
+  ASSERT_EQ(fgetc(file), EOF);
+  fclose(file);
+}
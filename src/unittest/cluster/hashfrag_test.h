@@ -0,0 +1,39 @@
+#include <iostream>
+#include "../../cluster/hashfrag.h"
+#include "gtest/gtest.h"
+using namespace swift_snails;
+
+TEST(BasicHashFrag, update) {
+  BasicHashFrag<size_t> hashfrag;
+  hashfrag.set_num_nodes(2);
+  hashfrag.init(4);
+  ASSERT_EQ(hashfrag.frag_node(0), 1);
+  ASSERT_EQ(hashfrag.frag_node(3), 2);
+  ASSERT_EQ(hashfrag.version(), 0);
+  ASSERT_TRUE(hashfrag.update(1, {{0, 2}}));
+  ASSERT_EQ(hashfrag.frag_node(0), 2);
+  ASSERT_EQ(hashfrag.frag_node(1), 1);
+  ASSERT_EQ(hashfrag.version(), 1);
+  // an update of an old version is dropped
+  ASSERT_FALSE(hashfrag.update(1, {{0, 1}}));
+  ASSERT_EQ(hashfrag.frag_node(0), 2);
+  for (size_t key = 0; key < 100; key++)
+    ASSERT_EQ(hashfrag.to_node_id(key),
+              hashfrag.frag_node(hashfrag.frag_id(key)));
+}
+
+TEST(BasicHashFrag, plan_moves) {
+  typedef BasicHashFrag<size_t> hashfrag_t;
+  // node 1 has 30 of the 40, one fragment evens it
+  std::map<int, int> expected = {{0, 2}};
+  ASSERT_EQ(hashfrag_t::plan_moves({1, 1, 1, 2}, {10, 10, 10, 10}, 2, 1.1, 8),
+            expected);
+  // a fragment heavier than the gap is not moved
+  ASSERT_TRUE(hashfrag_t::plan_moves({1, 2}, {100, 1}, 2, 1.1, 8).empty());
+  // nor is a fragment of no load, or one of unknown owner
+  ASSERT_TRUE(hashfrag_t::plan_moves({1, 1, 0}, {10, 0, 5}, 2, 1.1, 8).empty());
+  // moves are bounded
+  ASSERT_EQ(hashfrag_t::plan_moves({1, 1, 1, 1}, {1, 1, 1, 1}, 2, 1.1, 1)
+                .size(),
+            1);
+}
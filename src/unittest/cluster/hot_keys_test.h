@@ -0,0 +1,53 @@
+#include <iostream>
+#include "../../cluster/hot_keys.h"
+#include "gtest/gtest.h"
+using namespace swift_snails;
+
+TEST(HotKeyCounter, top) {
+  HotKeyCounter<size_t> counter(4);
+  std::vector<size_t> keys;
+  // key i is accessed i times
+  for (size_t key = 1; key <= 20; key++)
+    for (size_t i = 0; i < key; i++)
+      keys.push_back(key);
+  counter.add(keys);
+  std::vector<size_t> expected = {17, 18, 19, 20};
+  ASSERT_EQ(counter.top(4), expected);
+}
+
+TEST(HotKeyCounter, counts) {
+  HotKeyCounter<size_t> counter;
+  counter.add({7, 3, 5}, {10, 1, 100});
+  counter.add({3}, {20});
+  std::vector<size_t> expected = {3, 5};
+  ASSERT_EQ(counter.top(2), expected);
+  // fewer keys than asked for
+  ASSERT_EQ(counter.top(10).size(), 3);
+  ASSERT_TRUE(HotKeyCounter<size_t>().top(5).empty());
+}
+
+TEST(HotKeyCounter, decay) {
+  // every top() starts a new period
+  HotKeyCounter<size_t> counter(16, 0);
+  counter.add({1, 2}, {1, 8});
+  ASSERT_EQ(counter.top(2).size(), 2);
+  // counts are halved once per period, the key of count 1 is dropped
+  std::vector<size_t> expected = {2};
+  ASSERT_EQ(counter.top(2), expected);
+  // 2 is at 2 now, recent accesses of 1 take over
+  counter.add({1}, {3});
+  expected = {1};
+  ASSERT_EQ(counter.top(1), expected);
+}
+
+TEST(HotKeyCounter, snapshot) {
+  HotKeyCounter<size_t> counter(16, 3600 * 1000);
+  counter.add({1, 2}, {1, 8});
+  std::vector<size_t> expected = {2};
+  ASSERT_EQ(counter.top(1), expected);
+  // the period has not passed, later accesses wait for the next ranking
+  counter.add({1}, {100});
+  ASSERT_EQ(counter.top(1), expected);
+  // another k ranks the current counts, without decaying them again
+  ASSERT_EQ(counter.top(2).size(), 2);
+}
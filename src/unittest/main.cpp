@@ -1,5 +1,15 @@
 // utils
 #include "utils/common_test.h"
+#include "utils/buffer_test.h"
+#include "utils/file_test.h"
+// cluster
+#include "cluster/hot_keys_test.h"
+#include "cluster/chunk_queue_test.h"
+#include "cluster/hashfrag_test.h"
+// parameter
+#include "parameter/persistent_cache_test.h"
+#include "parameter/grad_buffer_test.h"
+#include "parameter/minibatch_tuner_test.h"
 
 int main(int argc, char **argv) {
 
@@ -0,0 +1,69 @@
+#include <iostream>
+#include "../../parameter/grad_buffer.h"
+#include "gtest/gtest.h"
+using namespace swift_snails;
+
+struct CountGrad {
+  int count = 0;
+  void reset() { count = 0; }
+  void merge(const CountGrad &other) { count += other.count; }
+};
+
+TEST(StripedLock, stripe_of) {
+  StripedLock locks(8);
+  ASSERT_EQ(locks.size(), 8);
+  for (size_t hash = 0; hash < 100; hash++)
+    ASSERT_LT(locks.stripe_of(hash), locks.size());
+  ASSERT_EQ(locks.stripe_of(3), locks.stripe_of(11));
+}
+
+TEST(GradBuffer, merge_into) {
+  const int num_threads = 4;
+  const size_t num_keys = 1000;
+  LocalParamCache<size_t, float, CountGrad> cache;
+  // half of the rows are in the cache before the merges
+  std::unordered_set<size_t> keys;
+  for (size_t key = 0; key < num_keys / 2; key++)
+    keys.insert(key);
+  cache.init_keys(keys);
+  StripedLock locks(16);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < num_threads; i++) {
+    threads.emplace_back([&cache, &locks, num_keys] {
+      GradBuffer<size_t, CountGrad> grads;
+      for (size_t key = 0; key < num_keys; key++)
+        grads[key].count += 1 + key % 2;
+      grads.merge_into(cache, locks);
+      // the buffer is cleared by the merge
+      grads.merge_into(cache, locks);
+    });
+  }
+  for (auto &t : threads)
+    t.join();
+  for (size_t key = 0; key < num_keys; key++) {
+    CountGrad *grad = cache.find_grad(key);
+    ASSERT_TRUE(grad != nullptr);
+    ASSERT_EQ(grad->count, num_threads * int(1 + key % 2));
+  }
+}
+
+TEST(SlotGradBuffer, rows) {
+  typedef SlotParamCache<size_t, float, CountGrad> cache_t;
+  cache_t cache;
+  cache.init_keys({10, 20, 30});
+  SlotGradBuffer<cache_t> grads(cache);
+  grads.grad(cache.slot(20)).count = 2;
+  grads.grad(cache.slot(30)).count += 1;
+  grads.grad(cache.slot(30)).count += 1;
+  std::unordered_set<size_t> written;
+  grads.keys(written);
+  ASSERT_EQ(written, std::unordered_set<size_t>({20, 30}));
+  ASSERT_TRUE(grads.find_grad(10) == nullptr);
+  ASSERT_EQ(grads.find_grad(30)->count, 2);
+  // rows are reset and reused after clear
+  grads.clear();
+  grads.keys(written);
+  ASSERT_TRUE(written.empty());
+  ASSERT_TRUE(grads.find_grad(20) == nullptr);
+  ASSERT_EQ(grads.grad(cache.slot(10)).count, 0);
+}
@@ -0,0 +1,54 @@
+#include <iostream>
+#include "../../parameter/minibatch_tuner.h"
+#include "gtest/gtest.h"
+using namespace swift_snails;
+
+BatchTimes batch_times(double comm, double compute) {
+  BatchTimes times;
+  times.pull = comm;
+  times.compute = compute;
+  return times;
+}
+
+TEST(MiniBatchTuner, steps) {
+  MiniBatchTuner tuner(100, 10, 1000, 1);
+  // the size changes once every 4 minibatches
+  for (int i = 0; i < 3; i++)
+    ASSERT_EQ(tuner.update(batch_times(4, 1)), 100);
+  // comm-bound, grows by half
+  ASSERT_EQ(tuner.update(batch_times(4, 1)), 150);
+  // compute-bound, the smoothed ratio falls below half of the target
+  int size = 150;
+  for (int i = 0; i < 4 * 4; i++)
+    size = tuner.update(batch_times(0, 1));
+  ASSERT_LT(size, 150);
+  // shrinks by a fifth each window
+  int last = tuner.size();
+  for (int i = 0; i < 4; i++)
+    size = tuner.update(batch_times(0, 1));
+  ASSERT_EQ(size, int(last * 0.8));
+}
+
+TEST(MiniBatchTuner, bounds) {
+  // the initial size is clamped
+  ASSERT_EQ(MiniBatchTuner(5000, 10, 1000, 1).size(), 1000);
+  ASSERT_EQ(MiniBatchTuner(1, 10, 1000, 1).size(), 10);
+  MiniBatchTuner tuner(800, 10, 1000, 1);
+  for (int i = 0; i < 4 * 4; i++)
+    tuner.update(batch_times(10, 1));
+  ASSERT_EQ(tuner.size(), 1000);
+  for (int i = 0; i < 4 * 40; i++)
+    tuner.update(batch_times(0, 1));
+  ASSERT_EQ(tuner.size(), 10);
+  // a ratio between half of the target and the target keeps the size
+  MiniBatchTuner stable(100, 10, 1000, 1);
+  for (int i = 0; i < 4 * 4; i++)
+    ASSERT_EQ(stable.update(batch_times(0.7, 1)), 100);
+}
+
+TEST(MiniBatchTuner, disabled) {
+  MiniBatchTuner tuner(100, 0, 0, 0);
+  ASSERT_FALSE(tuner.enabled());
+  for (int i = 0; i < 8; i++)
+    ASSERT_EQ(tuner.update(batch_times(10, 1)), 100);
+}
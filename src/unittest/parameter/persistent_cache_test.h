@@ -0,0 +1,64 @@
+#include <iostream>
+#include "../../parameter/persistent_cache.h"
+#include "gtest/gtest.h"
+using namespace swift_snails;
+
+TEST(RowLRU, staleness) {
+  RowLRU<size_t> rows(1);
+  std::unordered_set<size_t> to_pull;
+  rows.touch({1, 2}, to_pull);
+  ASSERT_EQ(to_pull, std::unordered_set<size_t>({1, 2}));
+  // reused by the next minibatch
+  rows.tick();
+  to_pull.clear();
+  rows.touch({1, 2, 3}, to_pull);
+  ASSERT_EQ(to_pull, std::unordered_set<size_t>({3}));
+  // pulled 2 minibatches ago, stale
+  rows.tick();
+  to_pull.clear();
+  rows.touch({1, 3}, to_pull);
+  ASSERT_EQ(to_pull, std::unordered_set<size_t>({1}));
+  // a row is stamped when pulled again
+  rows.tick();
+  to_pull.clear();
+  rows.touch({1, 3}, to_pull);
+  ASSERT_EQ(to_pull, std::unordered_set<size_t>({3}));
+}
+
+TEST(RowLRU, evict) {
+  RowLRU<size_t> rows(0);
+  std::unordered_set<size_t> to_pull;
+  rows.touch({1}, to_pull);
+  rows.touch({2}, to_pull);
+  rows.touch({3}, to_pull);
+  // 1 is the most recent now
+  rows.touch({1}, to_pull);
+  std::vector<size_t> evicted;
+  rows.evict(3, evicted);
+  ASSERT_TRUE(evicted.empty());
+  rows.evict(1, evicted);
+  ASSERT_EQ(evicted, std::vector<size_t>({2, 3}));
+  ASSERT_EQ(rows.size(), 1);
+  // an evicted row is pulled again
+  to_pull.clear();
+  rows.touch({1, 2}, to_pull);
+  ASSERT_EQ(to_pull, std::unordered_set<size_t>({2}));
+}
+
+TEST(LocalParamCache, erase) {
+  struct Grad {
+    float val = 0;
+    void reset() { val = 0; }
+  };
+  LocalParamCache<size_t, float, Grad> cache;
+  cache.enable_erase(std::numeric_limits<size_t>::max() - 1);
+  std::unordered_set<size_t> keys = {1, 2};
+  cache.init_keys(keys);
+  cache.find_grad(2)->val = 1;
+  cache.erase(1);
+  cache.erase(2, true);
+  ASSERT_EQ(cache.size(), 0);
+  ASSERT_TRUE(cache.find_grad(1) == nullptr);
+  // the residual grad is kept
+  ASSERT_EQ(cache.find_grad(2)->val, 1);
+}
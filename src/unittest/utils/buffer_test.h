@@ -0,0 +1,59 @@
+#include <iostream>
+#include "../../utils/all.h"
+#include "gtest/gtest.h"
+using namespace swift_snails;
+
+TEST(BinaryBuffer, varint) {
+  BinaryBuffer bb;
+  typedef unsigned long long value_t;
+  std::vector<value_t> values = {0,   1,         127,
+                                 128, 300,       1ULL << 35,
+                                 std::numeric_limits<value_t>::max()};
+  for (auto value : values)
+    bb.put_varint(value);
+  for (auto value : values)
+    ASSERT_EQ(bb.get_varint(), value);
+  ASSERT_TRUE(bb.read_finished());
+}
+
+TEST(BinaryBuffer, delta_block) {
+  BinaryBuffer bb;
+  std::vector<size_t> keys;
+  for (size_t i = 0; i < 1000; i++)
+    keys.push_back(get_hash_code(i));
+  std::sort(keys.begin(), keys.end());
+  std::vector<unsigned int> small_keys = {3, 3, 7, 1024, 70000};
+  bb.put_delta_block(keys);
+  bb.put_delta_block(small_keys);
+  bb << 1.5f;
+
+  std::vector<size_t> keys_;
+  std::vector<unsigned int> small_keys_;
+  bb.get_delta_block(keys_);
+  bb.get_delta_block(small_keys_);
+  ASSERT_EQ(keys, keys_);
+  ASSERT_EQ(small_keys, small_keys_);
+  ASSERT_EQ(bb.get<float>(), 1.5f);
+  ASSERT_TRUE(bb.read_finished());
+  // sorted small keys should take much less than raw size_t
+  std::vector<size_t> dense_keys;
+  for (size_t i = 0; i < 1000; i++)
+    dense_keys.push_back(i * 3);
+  BinaryBuffer dense;
+  dense.put_delta_block(dense_keys);
+  ASSERT_LT(dense.size(), dense_keys.size() * sizeof(size_t) / 4);
+}
+
+TEST(BinaryBuffer, move_assign) {
+  BinaryBuffer bb;
+  for (int i = 0; i < 1000; i++)
+    bb << i;
+  BinaryBuffer other;
+  other = std::move(bb);
+  ASSERT_EQ(bb.buffer(), nullptr);
+  ASSERT_EQ(other.size(), 1000 * sizeof(int));
+  other << 1000;
+  for (int i = 0; i <= 1000; i++)
+    ASSERT_EQ(other.get<int>(), i);
+  ASSERT_TRUE(other.read_finished());
+}
@@ -0,0 +1,67 @@
+#include <iostream>
+#include "../../utils/all.h"
+#include "gtest/gtest.h"
+using namespace swift_snails;
+
+struct LineInstance {
+  std::vector<int> words;
+  void clear() { words.clear(); }
+};
+
+TEST(InstanceArena, take) {
+  InstanceArena<LineInstance> arena;
+  for (int i = 0; i < 5; i++) {
+    auto &entry = arena.append();
+    entry.ins.words.push_back(i);
+    // lines 1 and 3 fail to parse
+    entry.valid = i % 2 == 0;
+  }
+  ASSERT_EQ(arena.size(), 5);
+  // valid instances in the order of the lines
+  std::vector<int> taken;
+  while (LineInstance *ins = arena.take())
+    taken.push_back(ins->words[0]);
+  ASSERT_EQ(taken, std::vector<int>({0, 2, 4}));
+  ASSERT_TRUE(arena.take() == nullptr);
+}
+
+TEST(InstanceArena, reuse) {
+  InstanceArena<LineInstance> arena;
+  auto &first = arena.append();
+  first.ins.words = {1, 2, 3};
+  first.valid = true;
+  ASSERT_TRUE(arena.take() != nullptr);
+  arena.clear();
+  ASSERT_EQ(arena.size(), 0);
+  ASSERT_TRUE(arena.take() == nullptr);
+  // the slot is reused, cleared and invalid until parsed
+  auto &again = arena.append();
+  ASSERT_EQ(&again, &first);
+  ASSERT_TRUE(again.ins.words.empty());
+  ASSERT_FALSE(again.valid);
+  again.valid = true;
+  ASSERT_EQ(arena.take(), &again.ins);
+}
+
+TEST(InstanceArena, concurrent_take) {
+  InstanceArena<LineInstance> arena;
+  const int num_lines = 10000;
+  for (int i = 0; i < num_lines; i++) {
+    auto &entry = arena.append();
+    entry.ins.words.push_back(i);
+    entry.valid = true;
+  }
+  // every instance is taken by exactly one thread
+  std::vector<std::atomic<int>> takes(num_lines);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; i++) {
+    threads.emplace_back([&arena, &takes] {
+      while (LineInstance *ins = arena.take())
+        takes[ins->words[0]]++;
+    });
+  }
+  for (auto &t : threads)
+    t.join();
+  for (int i = 0; i < num_lines; i++)
+    ASSERT_EQ(takes[i], 1);
+}
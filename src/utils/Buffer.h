@@ -48,6 +48,9 @@ public:
       _buffer = other._buffer;
       _cursor = other._cursor;
       _end = other._end;
+      _capacity = other._capacity;
+      other.set_buffer(nullptr); // the memory is owned by this now
+      other.clear();
     }
     return *this;
   }
@@ -190,8 +193,97 @@ public:
     *this >> x;
     return std::move(x);
   }
+  /**
+   * \brief write an unsigned integer as LEB128 varint
+   */
+  void put_varint(uint64_t x) {
+    byte_t buf[10];
+    size_t n = 0;
+    while (x >= 0x80) {
+      buf[n++] = byte_t(x) | 0x80;
+      x >>= 7;
+    }
+    buf[n++] = byte_t(x);
+    put_bytes(buf, n);
+  }
+
+  uint64_t get_varint() {
+    CHECK(!read_finished());
+    const char *pos = cursor();
+    uint64_t x = decode_varint(pos, end());
+    cursor_preceed(pos - cursor());
+    return x;
+  }
+  /**
+   * \brief write a block of sorted unsigned integers
+   *
+   * layout: varint count, then varint deltas between neighbouring values
+   *
+   * \warning `values` should be sorted in ascending order
+   */
+  template <typename T> void put_delta_block(const std::vector<T> &values) {
+    static_assert(std::is_unsigned<T>::value, "only unsigned values");
+    put_varint(values.size());
+    // at most 10 bytes each varint
+    reserve_more(10 * values.size());
+    T last = 0;
+    for (const T &value : values) {
+      DCHECK_GE(value, last);
+      uint64_t delta = value - last;
+      char *pos = end();
+      while (delta >= 0x80) {
+        *pos++ = char(byte_t(delta) | 0x80);
+        delta >>= 7;
+      }
+      *pos++ = char(delta);
+      end_preceed(pos - end());
+      last = value;
+    }
+  }
+  /**
+   * \brief decode a whole block written by `put_delta_block`
+   */
+  template <typename T> void get_delta_block(std::vector<T> &values) {
+    static_assert(std::is_unsigned<T>::value, "only unsigned values");
+    size_t num = get_varint();
+    values.resize(num);
+    const char *pos = cursor();
+    T last = 0;
+    for (size_t i = 0; i < num; i++) {
+      last += T(decode_varint(pos, end()));
+      values[i] = last;
+    }
+    cursor_preceed(pos - cursor());
+  }
 
 protected:
+  static uint64_t decode_varint(const char *&pos, const char *end) {
+    // a varint takes 10 bytes at most, the bytes are only checked against
+    // the end of the buffer near it
+    const bool near_end = end - pos < 10;
+    uint64_t x = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      if (near_end)
+        CHECK(pos < end) << "broken varint";
+      byte_t b = byte_t(*pos++);
+      x |= uint64_t(b & 0x7f) << shift;
+      if (b < 0x80)
+        return x;
+    }
+    LOG(FATAL) << "broken varint";
+    return x;
+  }
+  void reserve_more(size_t more) {
+    size_t newcap = std::max<size_t>(capacity(), 64);
+    while (size() + more > newcap)
+      newcap *= 2;
+    reserve(newcap);
+  }
+  void put_bytes(const void *x, size_t size) {
+    reserve_more(size);
+    memcpy(end(), x, size);
+    end_preceed(size);
+  }
   // T should be basic types
   template <typename T> void get_raw(T &x) {
     CHECK(!read_finished());
@@ -67,6 +67,15 @@ public:
     CHECK(p != s.end()) << "no such key:\t[" << session << "]\t" << key;
     return p->second;
   }
+  // optional key, `default_value` if the conf does not set it
+  Item get(const std::string &session, const std::string &key,
+           const std::string &default_value) {
+    auto &s = _session[session];
+    auto p = s.find(key);
+    if (p == s.end())
+      return Item(default_value);
+    return p->second;
+  }
 
   friend std::ostream &operator<<(std::ostream &os, const ConfigParser &other) {
     os << "conf:" << std::endl;
@@ -22,6 +22,12 @@ inline uint64_t get_hash_code(uint64_t x) {
   x ^= x >> 33;
   return x;
 }
+/**
+ * seeded hash, hashes of different seeds are independent of each other
+ */
+inline uint64_t get_hash_code(uint64_t x, uint64_t seed) {
+  return get_hash_code(x ^ get_hash_code(seed + 0x9e3779b97f4a7c15));
+}
 
 }; // end namespace swift_snails
 
@@ -31,6 +31,14 @@ public:
     return std::chrono::duration_cast<seconds>(high_resolution_clock::now() -
                                                _start);
   }
+  /**
+   * elapsed milliseconds, with the fraction
+   */
+  double elapsed_ms() const {
+    return std::chrono::duration<double, std::milli>(
+               high_resolution_clock::now() - _start)
+        .count();
+  }
   int time_span() const { return _time_span; }
   template <typename T, typename Traits>
   friend std::basic_ostream<T, Traits> &
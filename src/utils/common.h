@@ -11,10 +11,15 @@
 #define NDEBUG
 
 #include <iostream>
+#include <algorithm>
+#include <limits>
+#include <type_traits>
 #include <cstdio>
 #include <cstdlib>
 #include <string>
 #include <cstring>
+#include <deque>
+#include <list>
 #include <map>
 #include <set>
 #include <unordered_set>
@@ -32,6 +32,69 @@ void scan_file_by_line(FILE *file, std::mutex &file_mut,
   }
 }
 
+/**
+ * @brief parsed lines of a minibatch, kept for training so that each
+ * line is read and parsed once
+ *
+ * the instances are reused after `clear()` and keep their buffers. The
+ * slots are appended in the order of the lines under the lock of the
+ * file, then parsed into by different threads; after the gather
+ * `take()` hands the valid instances to the training threads in order.
+ *
+ * @param Instance with `clear()`
+ */
+template <typename Instance> class InstanceArena : public VirtualObject {
+public:
+  struct Entry {
+    Instance ins;
+    // whether the line is parsed to an instance
+    bool valid = false;
+  };
+  /**
+   * @brief slot of the next line, the slots appended before stay put
+   * @warning not thread-safe, call it while the line is read
+   */
+  Entry &append() {
+    if (_size == _entries.size())
+      _entries.emplace_back();
+    Entry &entry = _entries[_size++];
+    entry.ins.clear();
+    entry.valid = false;
+    return entry;
+  }
+  /**
+   * @brief next valid instance to train on, thread-safe
+   * @return nullptr if all are taken
+   */
+  Instance *take() {
+    size_t id = _cursor;
+    for (;;) {
+      // the cursor is not moved past the end, lines appended later are
+      // taken too
+      if (id >= _size)
+        return nullptr;
+      if (!_cursor.compare_exchange_weak(id, id + 1))
+        continue;
+      if (_entries[id].valid)
+        return &_entries[id].ins;
+      id++;
+    }
+  }
+  // number of lines
+  size_t size() const { return _size; }
+  // drop the lines, the instances are kept to be reused
+  void clear() {
+    _size = 0;
+    _cursor = 0;
+  }
+
+private:
+  // references stay valid while it grows
+  std::deque<Entry> _entries;
+  size_t _size = 0;
+  std::atomic<size_t> _cursor{0};
+}; // end class InstanceArena
+
 /**
  * parse file with keys like:
  *  112 113 224 445
@@ -20,11 +20,23 @@ public:
     std::strcpy(&_ip_table[IP_WIDTH * _rank], ip.c_str());
     CHECK(0 == MPI_Allgather(MPI_IN_PLACE, 0, MPI_BYTE, &_ip_table[0], IP_WIDTH,
                              MPI_BYTE, MPI_COMM_WORLD));
+    CHECK(0 == MPI_Query_thread(&_thread_level));
+    // point-to-point messages never mix with the collectives
+    CHECK(0 == MPI_Comm_dup(MPI_COMM_WORLD, &_p2p_comm));
+  }
+  /**
+   * \brief init MPI with full thread support if the library provides it
+   * the MPI transport sends from many threads
+   */
+  static void initialize(int argc, char **argv) {
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_MULTIPLE, &provided);
   }
 
-  static void initialize(int argc, char **argv) { MPI_Init(&argc, &argv); }
-
-  ~GlobalMPI() { MPI_Finalize(); }
+  ~GlobalMPI() {
+    MPI_Comm_free(&_p2p_comm);
+    MPI_Finalize();
+  }
 
   int rank() { return _rank; }
 
@@ -33,13 +45,49 @@ public:
   const char *ip() { return &_ip_table[rank() * IP_WIDTH]; }
 
   const char *ip(int rank) { return &_ip_table[rank * IP_WIDTH]; }
+  /**
+   * \brief the lowest rank on the host of `rank`
+   */
+  int host_leader(int rank) {
+    for (int i = 0; i < rank; i++) {
+      if (std::strcmp(ip(i), ip(rank)) == 0)
+        return i;
+    }
+    return rank;
+  }
+  // number of ranks on the host of `rank`
+  int host_size(int rank) {
+    int num = 0;
+    for (int i = 0; i < _size; i++) {
+      if (std::strcmp(ip(i), ip(rank)) == 0)
+        num++;
+    }
+    return num;
+  }
 
   void barrier() { CHECK(0 == MPI_Barrier(MPI_COMM_WORLD)); }
 
+  /**
+   * \brief whether `value` is true on any rank
+   * \warning a collective, every rank should call it
+   */
+  bool any(bool value) {
+    int local = value, global = 0;
+    CHECK(0 == MPI_Allreduce(&local, &global, 1, MPI_INT, MPI_LOR,
+                             MPI_COMM_WORLD));
+    return global != 0;
+  }
+
+  bool thread_multiple() const { return _thread_level == MPI_THREAD_MULTIPLE; }
+  // communicator of the MPI transport
+  MPI_Comm p2p_comm() const { return _p2p_comm; }
+
 private:
   int _rank;
   int _size;
   std::vector<char> _ip_table;
+  int _thread_level = MPI_THREAD_SINGLE;
+  MPI_Comm _p2p_comm;
 
 }; // end GlobalMPI
 